@@ -0,0 +1,52 @@
+#pragma once
+#include <sensor_msgs/PointCloud2.h>
+#include <sensor_msgs/PointField.h>
+#include <pcl/point_types.h>
+#include <pcl/point_cloud.h>
+#include <Eigen/Dense>
+#include <cstring>
+#include <string>
+
+// Read-only view of x/y/z/rgb straight out of a PointCloud2 buffer using
+// the message's field offsets, so filters can consume a cloud without the
+// copy and repack done by pcl::fromROSMsg. The message must outlive the view.
+class PointCloud2View
+{
+public:
+  explicit PointCloud2View(const sensor_msgs::PointCloud2 &msg);
+
+  // false if x/y/z are missing or not FLOAT32, callers should fall back to fromROSMsg
+  bool valid() const { return valid_; }
+  bool has_rgb() const { return rgb_offset_ >= 0; }
+  size_t size() const { return size_t(width_) * height_; }
+  uint32_t width() const { return width_; }
+  uint32_t height() const { return height_; }
+
+  // one pass copy for stages that need an owned cloud, e.g. as an ICP target
+  void copy_to(pcl::PointCloud<pcl::PointXYZRGB> &cloud) const;
+
+  // p is (x, y, z, 1) in the message frame, rgba is 0 without a color field
+  inline void read(size_t i, Eigen::Vector4f &p, uint32_t &rgba) const
+  {
+    const uint8_t *pt = contiguous_ ? data_ + i * point_step_
+                                    : data_ + (i / width_) * row_step_ + (i % width_) * point_step_;
+    std::memcpy(&p[0], pt + x_offset_, sizeof(float));
+    std::memcpy(&p[1], pt + y_offset_, sizeof(float));
+    std::memcpy(&p[2], pt + z_offset_, sizeof(float));
+    p[3] = 1.0f;
+    if (rgb_offset_ >= 0)
+      std::memcpy(&rgba, pt + rgb_offset_, sizeof(uint32_t));
+    else
+      rgba = 0;
+  }
+
+private:
+  const uint8_t *data_;
+  uint32_t width_, height_, point_step_, row_step_;
+  int x_offset_, y_offset_, z_offset_, rgb_offset_;
+  bool contiguous_;
+  bool is_dense_;
+  bool valid_;
+
+  static int field_offset_(const sensor_msgs::PointCloud2 &msg, const std::string &name, uint8_t datatype);
+};
@@ -0,0 +1,52 @@
+#pragma once
+#include <ros/ros.h>
+#include <tf/tf.h>
+#include <tf/transform_listener.h>
+#include <tf2_msgs/TFMessage.h>
+#include <pcl_ros/transforms.h>
+#include <Eigen/Geometry>
+#include <Eigen/StdVector>
+#include <mutex>
+#include <map>
+#include <set>
+
+// Camera-to-base transforms resolved once and reused across frames. Only
+// frames joined to the target through /tf_static links are cached, a
+// camera on the arm is looked up every frame. An entry is dropped when
+// /tf_static republishes or when it is older than timeout; a timeout <= 0
+// keeps entries until the next /tf_static message.
+class ExtrinsicsCache
+{
+public:
+  ExtrinsicsCache(ros::NodeHandle &nh, tf::TransformListener &listener, const std::string &target_frame, double timeout);
+
+  // throws tf::TransformException if the transform cannot be resolved
+  Eigen::Affine3f lookup(const std::string &source_frame);
+  void invalidate();
+
+private:
+  struct Entry
+  {
+    EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+    Eigen::Affine3f tf;
+    ros::WallTime stamp;
+  };
+  typedef std::map<std::string, Entry, std::less<std::string>,
+                   Eigen::aligned_allocator<std::pair<const std::string, Entry>>>
+      EntryMap;
+
+  tf::TransformListener &listener_;
+  ros::Subscriber tf_static_sub_;
+  std::string target_frame_;
+  ros::WallDuration timeout_;
+
+  std::mutex mutex_;
+  EntryMap entries_;
+  // child to parent of every /tf_static transform seen so far
+  std::map<std::string, std::string> static_parents_;
+
+  void tf_static_cb_(const tf2_msgs::TFMessage::ConstPtr &msg);
+  // true if source_frame reaches target_frame_ through static links only,
+  // called with mutex_ held
+  bool is_static_(const std::string &source_frame) const;
+};
@@ -0,0 +1,75 @@
+#pragma once
+#include <ros/ros.h>
+#include <pcl/point_types.h>
+#include <pcl/point_cloud.h>
+#include <pcl/features/fpfh_omp.h>
+#include <pcl/features/normal_3d_omp.h>
+#include <pcl/registration/sample_consensus_prerejective.h>
+#include <mars_perception/mesh_cache.h>
+#include <Eigen/Dense>
+#include <memory>
+#include <mutex>
+#include <map>
+#include <string>
+
+// Global initial pose from FPFH features matched with RANSAC
+// (SampleConsensusPrerejective), so ICP only has to refine. Model features
+// are computed once per mesh and kept, scene features once per set_scene().
+// max_iterations bounds the RANSAC time.
+class FeatureAligner
+{
+public:
+  typedef pcl::PointXYZRGB PointT;
+  typedef pcl::PointCloud<PointT> PointCloudT;
+  typedef pcl::PointNormal PointNT;
+  typedef pcl::PointCloud<PointNT> PointCloudNT;
+  typedef pcl::FPFHSignature33 FeatureT;
+  typedef pcl::PointCloud<FeatureT> FeatureCloudT;
+
+  struct Params
+  {
+    double leaf_size;
+    double normal_radius;
+    double feature_radius;
+    int max_iterations;
+    int samples;
+    int correspondence_randomness;
+    double similarity_threshold;
+    double max_correspondence_distance;
+    double inlier_fraction;
+    int threads;
+  };
+
+  explicit FeatureAligner(const Params &params);
+
+  // reads ~<ns>/leaf_size etc., missing values keep their defaults
+  static Params load_params(ros::NodeHandle &nh);
+
+  // safe to call from several threads, e.g. right after a mesh is loaded.
+  // Runs single threaded, models not prepared get ~threads on first use.
+  void prepare_model(const MeshModelConstPtr &model);
+  void set_scene(const PointCloudT::ConstPtr &scene);
+
+  // model to scene transform, false if RANSAC found no consistent pose
+  bool align(const MeshModelConstPtr &model, Eigen::Matrix4f &tf, double *inlier_fraction = nullptr);
+
+private:
+  struct Features
+  {
+    PointCloudNT::Ptr points;
+    FeatureCloudT::Ptr features;
+  };
+  struct ModelEntry
+  {
+    std::weak_ptr<const MeshModel> model;
+    std::shared_ptr<const Features> features;
+  };
+
+  Params params_;
+  std::mutex mutex_;
+  std::map<std::string, ModelEntry> models_;
+  std::shared_ptr<const Features> scene_;
+
+  std::shared_ptr<const Features> model_features_(const MeshModelConstPtr &model, int threads);
+  void compute_features_(Features &f, int threads) const;
+};
@@ -0,0 +1,148 @@
+#pragma once
+#include <pcl/point_types.h>
+#include <pcl/point_cloud.h>
+#include <mars_perception/cloud_view.h>
+#include <Eigen/Dense>
+#include <Eigen/Geometry>
+#include <Eigen/StdVector>
+#include <unordered_map>
+#include <algorithm>
+#include <vector>
+#include <limits>
+#include <cmath>
+
+// Single-pass replacement for transformPointCloud + CropBox + VoxelGrid.
+// Every point is read once, moved into the base frame with a 4x4 SIMD
+// multiply, rejected against the crop box and accumulated straight into
+// its voxel. The voxel grid is anchored at the origin like pcl::VoxelGrid,
+// so both pick the same voxels and emit them in the same index order.
+class FusedCloudFilter
+{
+public:
+  EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+  typedef pcl::PointXYZRGB PointT;
+  typedef pcl::PointCloud<PointT> PointCloudT;
+
+  FusedCloudFilter();
+  FusedCloudFilter(const Eigen::Vector3f &box_min, const Eigen::Vector3f &box_max, const Eigen::Vector3f &leaf_size);
+
+  void set_box(const Eigen::Vector3f &box_min, const Eigen::Vector3f &box_max);
+  void set_leaf_size(const Eigen::Vector3f &leaf_size);
+
+  void filter(const PointCloudT &in, const Eigen::Affine3f &extrinsic, PointCloudT &out);
+  void filter(const PointCloud2View &in, const Eigen::Affine3f &extrinsic, PointCloudT &out);
+
+  // read(i, p, rgba) must fill p with (x, y, z, 1) in the sensor frame
+  template <typename ReadPoint>
+  void filter(size_t n_points, ReadPoint read, const Eigen::Affine3f &extrinsic, PointCloudT &out);
+
+private:
+  struct Voxel
+  {
+    EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+    Eigen::Vector4f sum; // w accumulates the point count
+    uint32_t r, g, b, a;
+  };
+
+  Eigen::Vector4f box_min_, box_max_, inv_leaf_;
+  Eigen::Array4i grid_min_;
+  uint64_t grid_dx_, grid_dxy_;
+
+  // grids up to MAX_DENSE_CELLS index voxels through a flat table, finer
+  // grids fall back to the hash map
+  static constexpr uint64_t MAX_DENSE_CELLS = 1 << 22;
+  static constexpr uint32_t EMPTY_SLOT = std::numeric_limits<uint32_t>::max();
+
+  // reused across frames so steady state filtering does not allocate
+  std::vector<uint32_t> dense_slots_;
+  std::unordered_map<uint64_t, uint32_t> voxel_slots_;
+  std::vector<Voxel, Eigen::aligned_allocator<Voxel>> voxels_;
+  std::vector<std::pair<uint64_t, uint32_t>> order_;
+
+  void update_grid_();
+
+  inline uint32_t find_slot_(uint64_t key)
+  {
+    uint32_t slot;
+    if (!dense_slots_.empty())
+    {
+      slot = dense_slots_[key];
+      if (slot != EMPTY_SLOT)
+        return slot;
+      slot = dense_slots_[key] = static_cast<uint32_t>(voxels_.size());
+    }
+    else
+    {
+      auto it = voxel_slots_.emplace(key, static_cast<uint32_t>(voxels_.size()));
+      if (!it.second)
+        return it.first->second;
+      slot = it.first->second;
+    }
+    voxels_.emplace_back();
+    voxels_.back().sum.setZero();
+    voxels_.back().r = voxels_.back().g = voxels_.back().b = voxels_.back().a = 0;
+    order_.emplace_back(key, slot);
+    return slot;
+  }
+};
+
+template <typename ReadPoint>
+void FusedCloudFilter::filter(size_t n_points, ReadPoint read, const Eigen::Affine3f &extrinsic, PointCloudT &out)
+{
+  const Eigen::Matrix4f m = extrinsic.matrix();
+  voxel_slots_.clear();
+  voxels_.clear();
+  order_.clear();
+
+  Eigen::Vector4f p;
+  uint32_t rgba;
+  uint64_t last_key = std::numeric_limits<uint64_t>::max();
+  uint32_t last_slot = 0;
+  for (size_t i = 0; i < n_points; ++i)
+  {
+    read(i, p, rgba);
+    const Eigen::Vector4f q = m * p;
+
+    // NaNs fail both comparisons, so invalid returns drop out here too
+    if (!((q.array() >= box_min_.array()).all() && (q.array() <= box_max_.array()).all()))
+      continue;
+
+    const Eigen::Array4i idx = (q.array() * inv_leaf_.array()).floor().cast<int>() - grid_min_;
+    const uint64_t key = uint64_t(idx[0]) + uint64_t(idx[1]) * grid_dx_ + uint64_t(idx[2]) * grid_dxy_;
+
+    // neighbouring pixels of an organized cloud mostly share a voxel, so
+    // only go to the hash when the key changes
+    if (key != last_key)
+    {
+      last_key = key;
+      last_slot = find_slot_(key);
+    }
+    Voxel &v = voxels_[last_slot];
+    v.sum += q;
+    v.r += (rgba >> 16) & 0xff;
+    v.g += (rgba >> 8) & 0xff;
+    v.b += rgba & 0xff;
+    v.a += (rgba >> 24) & 0xff;
+  }
+
+  std::sort(order_.begin(), order_.end());
+  if (!dense_slots_.empty())
+  {
+    // only touched cells are reset, the table itself is never cleared
+    for (const auto &kv : order_)
+      dense_slots_[kv.first] = EMPTY_SLOT;
+  }
+
+  out.resize(order_.size());
+  for (size_t k = 0; k < order_.size(); ++k)
+  {
+    const Voxel &v = voxels_[order_[k].second];
+    const uint32_t n = static_cast<uint32_t>(v.sum[3]);
+    PointT &pt = out.points[k];
+    pt.getVector4fMap() = v.sum / v.sum[3];
+    pt.rgba = (v.a / n) << 24 | (v.r / n) << 16 | (v.g / n) << 8 | (v.b / n);
+  }
+  out.width = static_cast<uint32_t>(out.points.size());
+  out.height = 1;
+  out.is_dense = true;
+}
@@ -8,11 +8,31 @@
 #include <Eigen/Geometry>
 #include <pcl/io/vtk_lib_io.h>
 #include <pcl/registration/icp.h>
+#include <pcl/common/transforms.h>
+#include <pcl/common/common.h>
+#include <pcl/filters/voxel_grid.h>
+#include <pcl/search/kdtree.h>
 #include <tf/transform_broadcaster.h>
 #include <tf/transform_listener.h>
 #include <pcl_conversions/pcl_conversions.h>
 #include <mars_msgs/ICPMeshTF.h>
+#include <mars_msgs/ICPMeshTFBatch.h>
+#include <mars_msgs/RegisterMeshAction.h>
+#include <actionlib/server/simple_action_server.h>
+#include <ros/callback_queue.h>
 #include <mars_perception/mesh_sampling.h>
+#include <mars_perception/cloud_view.h>
+#include <mars_perception/mesh_cache.h>
+#include <mars_perception/icp_pyramid.h>
+#include <mars_perception/feature_alignment.h>
+#include <mars_perception/latest_value.h>
+#include <mars_perception/instance_label.h>
+#include <boost/asio/thread_pool.hpp>
+#include <boost/asio/post.hpp>
+#include <future>
+#include <mutex>
+#include <thread>
+#include <functional>
 
 #define ICP_CONVERGE_SLEEP_TIME 1.5
 
@@ -24,28 +44,168 @@ public:
     typedef pcl::PointCloud<Point>::Ptr PointCloudPtr;
     typedef sensor_msgs::PointCloud2 PointCloudMsg;
     typedef Eigen::Matrix4f TFMatrix;
-    ICP();
+    typedef pcl::search::KdTree<Point> SearchTree;
+    typedef actionlib::SimpleActionServer<mars_msgs::RegisterMeshAction> RegisterMeshServer;
+    ICP(ros::NodeHandle &nh, ros::NodeHandle &pnh);
     bool mesh_icp_srv(mars_msgs::ICPMeshTF::Request &req, mars_msgs::ICPMeshTF::Response &resp);
+    // registers every listed mesh against the same scene snapshot
+    bool mesh_icp_batch_srv(mars_msgs::ICPMeshTFBatch::Request &req, mars_msgs::ICPMeshTFBatch::Response &resp);
     void run();
 private:
+    // a PyramidICP whose levels follow the current model and scene
+    struct PyramidStage
+    {
+        PyramidICP icp;
+        MeshModelConstPtr model;
+        uint64_t generation = 0;
+    };
+    struct ObjectPose
+    {
+        TFMatrix tf;
+        double fitness;
+        // false if progress stopped the registration early
+        bool complete;
+    };
+    // called with the best pose after every ICP level or pass, returning
+    // false stops the registration
+    typedef std::function<bool(size_t step, size_t steps, const TFMatrix &tf, double fitness)> Progress;
+
+    // held by everything that aligns or touches the stages below, the
+    // action thread and the main thread both register
+    std::mutex icp_mutex_;
+    // the scene callback only stores the message, update_scene_()
+    // converts the newest one when an alignment is about to use it
+    LatestValue<PointCloudMsg> scene_msg_;
+    // MaskDepth's labelled cloud when ~labelled_points_topic is set, meshes
+    // named in /detect_class_names register against their class's points
+    // only, voxelized to ~labelled_leaf_size
+    std::string labelled_topic_;
+    LatestValue<PointCloudMsg> labelled_msg_;
+    std::vector<std::string> class_names_;
+    double labelled_leaf_size_;
+
+    // message generation and class (-1 for the whole scene) a scene was
+    // made from
+    struct SceneSource
+    {
+        int class_index;
+        uint64_t generation;
+        bool operator==(const SceneSource &other) const
+        {
+            return class_index == other.class_index && generation == other.generation;
+        }
+    };
+    SceneSource scene_source_;
+    // the last class selection that came up empty, not retried
+    SceneSource empty_selection_;
+
     PointCloudPtr mesh_pc_;
-    PointCloudPtr scene_pc_;
+    // replaced, never changed, once handed to the search structures
+    PointCloud::ConstPtr scene_pc_;
+    // counts the scenes scene_pc_ was replaced with, the scene search
+    // structure is only rebuilt when it was built for an older scene. A
+    // voxel hash when ~icp_voxel_hash_cell is set and covers
+    // max_correspondence_distance in a few cells, else a tree.
+    uint64_t scene_generation_;
+    double hash_cell_;
+    int correspondence_threads_;
+    SearchTree::Ptr scene_tree_;
+    VoxelHash::ConstPtr scene_hash_;
+    uint64_t scene_search_generation_;
+
+    // coarse to fine alignment when ~pyramid is set
+    PyramidStage pyramid_;
+    ICPMethod default_method_;
+    ICPMethod method_;
+
+    // optional feature based initial pose for service calls, refined with
+    // ~feature_alignment/refine_levels when those are set
+    std::unique_ptr<FeatureAligner> feature_aligner_;
+    uint64_t feature_generation_;
+    PyramidStage refine_;
+
+    // between calls the timer follows the last pose with a single tight
+    // point to point level against the scene around the model, see ~tracking
+    bool tracking_enabled_;
+    double tracking_margin_;
+    int tracking_min_points_;
+    PyramidStage tracking_;
+    Eigen::Vector3f model_min_;
+    Eigen::Vector3f model_max_;
+    uint64_t tracked_generation_;
+    double tracking_ms_;
+
+    // service calls start one pyramid run per rotation, plus the last pose
+    // found for the mesh, and keep the best scoring one
+    std::vector<TFMatrix> hypothesis_rotations_;
+    bool hypothesis_last_pose_;
+    double hypothesis_keep_ratio_;
+    std::map<std::string, TFMatrix> last_poses_;
+    std::unique_ptr<boost::asio::thread_pool> worker_pool_;
+
+    // after feature_aligner_, so loader threads are joined before the
+    // aligner they report to is destroyed
+    std::unique_ptr<MeshCache> mesh_cache_;
+    MeshModelConstPtr model_;
+
     ros::NodeHandle nh_;
+    ros::NodeHandle pnh_;
+    ros::Timer run_timer_;
     ros::ServiceServer icp_mesh_srv_;
+    ros::ServiceServer icp_batch_srv_;
+    // register_mesh goals and cancels arrive on their own queue and
+    // spinner, so they are served while the main thread is busy
+    ros::CallbackQueue action_queue_;
+    std::unique_ptr<RegisterMeshServer> register_action_;
+    std::unique_ptr<ros::AsyncSpinner> action_spinner_;
     ros::Publisher mesh_pub_;
     ros::Subscriber scene_pc_sub_;
+    ros::Subscriber labelled_pc_sub_;
     tf::TransformListener tf_listener_;
     tf::TransformBroadcaster br_;
 
     std::string mesh_name_;
     std::string base_frame_;
     TFMatrix tf_;
+    double fitness_;
     double max_corresp_dist_;
     double transf_epsilon_;
     double fitness_epsilon_;
     double max_iter_;
 
-    void set_mesh_(std::string);
+    // makes model the tracked mesh, starting from identity
+    void set_mesh_(const std::string &mesh_name, const MeshModelConstPtr &model);
     void scene_pc_cb_(const PointCloudMsg::ConstPtr& msg);
+    void labelled_pc_cb_(const PointCloudMsg::ConstPtr &msg);
+    // makes scene_pc_ the newest scene for mesh_name, its class's points
+    // when labels are on and there are any, else the whole scene
+    void update_scene_(const std::string &mesh_name);
+    void set_scene_(const PointCloudPtr &scene, const SceneSource &source);
+    PointCloudPtr select_class_(const PointCloudMsg &msg, int class_index) const;
+    void register_mesh_cb_(const mars_msgs::RegisterMeshGoalConstPtr &goal);
+    void prepare_scene_search_();
+    void set_scene_search_(pcl::IterativeClosestPoint<Point, Point> &icp) const;
+    // aligned against the scene search structure within max_corresp_dist_
+    ICPScore score_scene_(const PointCloud &aligned) const;
+    // the request's method, or ~method when empty, false if unknown
+    bool parse_method_(const std::string &name, ICPMethod &method) const;
+    void prepare_target_(PyramidStage &stage);
+    void prepare_stage_(PyramidStage &stage);
+    // builds everything that depends on the scene only, after this
+    // register_model_ may run for several models at once
+    void prepare_scene_();
+    TFMatrix align_stage_(PyramidStage &stage, const TFMatrix &guess);
+    // pose.tf holds the guess on entry
+    void align_hypotheses_(const PyramidICP &icp, const std::string &name, bool parallel, const Progress &progress,
+                           ObjectPose &pose);
+    void align_levels_(const PyramidICP &icp, const Progress &progress, ObjectPose &pose);
+    ObjectPose register_model_(const MeshModelConstPtr &model, bool parallel, const Progress &progress = Progress());
+    void parallel_for_(size_t n, const std::function<void(size_t)> &body);
+    void broadcast_tf_(const std::string &mesh_name, const TFMatrix &tf);
+    void fill_pose_(const std::string &mesh_name, const TFMatrix &tf, geometry_msgs::PoseStamped &pose);
+    void publish_pose_();
+    void track_();
+    void crop_to_model_(const PointCloud &scene, PointCloud &roi) const;
+    void set_icp_params_(pcl::IterativeClosestPoint<Point, Point> &icp) const;
 
 };
@@ -0,0 +1,162 @@
+#pragma once
+#include <ros/ros.h>
+#include <pcl/point_types.h>
+#include <pcl/point_cloud.h>
+#include <pcl/registration/icp.h>
+#include <pcl/search/kdtree.h>
+#include <mars_perception/voxel_hash.h>
+#include <Eigen/Dense>
+#include <string>
+#include <vector>
+#include <limits>
+
+// One resolution of the ICP pyramid. leaf_size 0 aligns the clouds as given.
+struct ICPLevel
+{
+  double leaf_size;
+  double max_correspondence_distance;
+  int max_iterations;
+  double transformation_epsilon;
+};
+
+enum class ICPMethod
+{
+  POINT_TO_POINT,
+  // minimizes distances along the target normals, converges in far fewer
+  // iterations on planar faces but needs normals on both clouds
+  POINT_TO_PLANE
+};
+
+struct ICPScore
+{
+  // mean squared distance of the source points that found a target within
+  // the level's correspondence distance, and the share of those points
+  double fitness;
+  double inlier_ratio;
+};
+
+// like getFitnessScore, plus the share of aligned points that found a
+// target within max_distance, so a pose touching only a few points does
+// not look good. Searches hash when it is set, else tree.
+template <typename PointType>
+ICPScore score_alignment(const pcl::PointCloud<PointType> &aligned, const VoxelHash *hash,
+                         const pcl::search::KdTree<PointType> *tree, double max_distance)
+{
+  const double max_sqr = max_distance * max_distance;
+  std::vector<int> index(1);
+  std::vector<float> sqr_dist(1);
+  double sum = 0.0;
+  size_t inliers = 0;
+  for (const PointType &p : aligned.points)
+  {
+    if (hash)
+    {
+      if (hash->nearest(p.getVector3fMap(), max_sqr, sqr_dist[0]) >= 0)
+      {
+        sum += sqr_dist[0];
+        ++inliers;
+      }
+    }
+    else if (tree && tree->nearestKSearch(p, 1, index, sqr_dist) > 0 && sqr_dist[0] <= max_sqr)
+    {
+      sum += sqr_dist[0];
+      ++inliers;
+    }
+  }
+  ICPScore score;
+  score.fitness = inliers ? sum / inliers : std::numeric_limits<double>::max();
+  score.inlier_ratio = aligned.empty() ? 0.0 : double(inliers) / aligned.size();
+  return score;
+}
+
+// "point_to_point" or "point_to_plane", false for anything else
+bool parse_icp_method(const std::string &name, ICPMethod &method);
+
+// Coarse to fine ICP. Source and target are voxelized once per level when
+// they are set, every level starts from the transform of the previous one,
+// so most iterations run on clouds a fraction of the full size.
+class PyramidICP
+{
+public:
+  typedef pcl::PointXYZRGB PointT;
+  typedef pcl::PointCloud<PointT> PointCloudT;
+  typedef pcl::search::KdTree<PointT> SearchTree;
+  typedef pcl::PointXYZRGBNormal PointNT;
+  typedef pcl::PointCloud<PointNT> PointCloudNT;
+
+  PyramidICP();
+  explicit PyramidICP(const std::vector<ICPLevel> &levels, ICPMethod method = ICPMethod::POINT_TO_POINT);
+
+  // reads a list of {leaf_size, max_correspondence_distance, max_iterations,
+  // transformation_epsilon} maps, coarsest first
+  static bool load_levels(ros::NodeHandle &nh, const std::string &param, std::vector<ICPLevel> &levels);
+
+  void set_levels(const std::vector<ICPLevel> &levels);
+  bool empty() const { return levels_.empty(); }
+  void set_fitness_epsilon(double epsilon) { fitness_epsilon_ = epsilon; }
+
+  // switching methods rebuilds the levels of both clouds
+  void set_method(ICPMethod method);
+  ICPMethod method() const { return method_; }
+  // lower bound of the target normal radius, each level uses at least
+  // 2.5 leaf sizes
+  void set_normal_radius(double radius) { normal_radius_ = radius; }
+  // smallest voxel hash cell for the target correspondences, levels use at
+  // least their leaf size. Levels whose correspondence distance spans more
+  // than a few cells, and 0, search KD-trees instead. Takes effect with
+  // the next set_target().
+  void set_hash_cell(double cell) { hash_cell_ = cell; }
+  // OpenMP threads matching source points, per align_level call
+  void set_correspondence_threads(int threads) { correspondence_threads_ = threads; }
+
+  // point to plane takes the source normals from source_normals
+  void set_source(const PointCloudT::ConstPtr &source, const PointCloudNT::ConstPtr &source_normals = PointCloudNT::ConstPtr());
+  // full_tree, if given, is used for full resolution point to point levels
+  // instead of building another one over target. Point to plane estimates
+  // the target normals here, once per target.
+  void set_target(const PointCloudT::ConstPtr &target, const SearchTree::Ptr &full_tree = SearchTree::Ptr());
+
+  // returns the source to target transform, fitness is the mean squared
+  // distance of the finest level
+  Eigen::Matrix4f align(const Eigen::Matrix4f &guess, double *fitness = nullptr);
+
+  // runs a single level, safe to call from several threads at once as long
+  // as the clouds and settings are not changed meanwhile
+  size_t level_count() const { return levels_.size(); }
+  Eigen::Matrix4f align_level(size_t level, const Eigen::Matrix4f &guess, ICPScore *score = nullptr) const;
+
+  // wall time of each level in the last align(), in ms
+  const std::vector<double> &level_times() const { return level_times_; }
+
+private:
+  template <typename PointType>
+  struct Level
+  {
+    typename pcl::PointCloud<PointType>::ConstPtr source;
+    typename pcl::PointCloud<PointType>::ConstPtr target;
+    // one of the two, depending on hash_cell_
+    typename pcl::search::KdTree<PointType>::Ptr tree;
+    VoxelHash::ConstPtr hash;
+  };
+
+  std::vector<ICPLevel> levels_;
+  ICPMethod method_;
+  double fitness_epsilon_;
+  double normal_radius_;
+  double hash_cell_;
+  int correspondence_threads_;
+  PointCloudT::ConstPtr source_;
+  PointCloudNT::ConstPtr source_normals_;
+  PointCloudT::ConstPtr target_;
+  SearchTree::Ptr full_tree_;
+  std::vector<Level<PointT>> point_levels_;
+  std::vector<Level<PointNT>> plane_levels_;
+  std::vector<double> level_times_;
+
+  void build_source_levels_();
+  void build_target_levels_();
+
+  template <typename PointType, typename Registration>
+  Eigen::Matrix4f align_level_(const Level<PointType> &level, const ICPLevel &params, const Eigen::Matrix4f &guess,
+                               ICPScore *score) const;
+};
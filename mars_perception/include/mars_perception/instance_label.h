@@ -0,0 +1,18 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+
+// label field of MaskDepth's points. The upper 16 bits hold the class as its
+// index in /detect_class_names plus one, 0 for a point without a class, the
+// lower 16 bits the instance as camera index * 256 + detection index, so
+// objects seen by two cameras are two instances.
+inline uint32_t make_instance_label(int class_index, size_t camera, size_t detection)
+{
+  return (uint32_t(class_index + 1) << 16) | ((uint32_t(camera) & 0xFF) << 8) | (uint32_t(detection) & 0xFF);
+}
+
+// index in /detect_class_names, -1 for none
+inline int label_class_index(uint32_t label)
+{
+  return int(label >> 16) - 1;
+}
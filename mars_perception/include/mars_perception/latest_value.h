@@ -0,0 +1,46 @@
+#pragma once
+#include <boost/shared_ptr.hpp>
+#include <boost/make_shared.hpp>
+#include <cstdint>
+
+// Single slot holding the newest message of a topic. The subscriber
+// replaces it and readers take whatever is there, without copies and
+// without blocking the writer on readers: the atomic shared_ptr swaps go
+// through boost's spinlock pool, held only for the pointer exchange, so a
+// fast topic costs one short swap per message while nobody reads.
+// Each stored message gets the next generation, readers compare it to skip
+// work on a message they have already seen. One writer only.
+template <typename M>
+class LatestValue
+{
+public:
+  typedef boost::shared_ptr<const M> ConstPtr;
+
+  LatestValue() : slot_(boost::make_shared<const Slot>()) {}
+
+  void store(const ConstPtr &value)
+  {
+    boost::shared_ptr<const Slot> last = boost::atomic_load(&slot_);
+    boost::atomic_store(&slot_, boost::make_shared<const Slot>(value, last->generation + 1));
+  }
+
+  // null with generation 0 until the first store
+  ConstPtr load(uint64_t &generation) const
+  {
+    boost::shared_ptr<const Slot> slot = boost::atomic_load(&slot_);
+    generation = slot->generation;
+    return slot->value;
+  }
+
+private:
+  // value and generation are swapped together
+  struct Slot
+  {
+    Slot() : generation(0) {}
+    Slot(const ConstPtr &value, uint64_t generation) : value(value), generation(generation) {}
+    ConstPtr value;
+    uint64_t generation;
+  };
+
+  boost::shared_ptr<const Slot> slot_;
+};
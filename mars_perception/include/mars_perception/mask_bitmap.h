@@ -0,0 +1,78 @@
+#pragma once
+#include <sensor_msgs/Image.h>
+#include <cstdint>
+#include <vector>
+
+// Union of instance masks at one bit per pixel, rows padded to whole 64 bit
+// words. Masks are read straight from the 8 bit image buffers, eight pixels
+// per step, and only inside the box they are given, so a frame costs about
+// the area of its instances. The storage is kept between frames: reset()
+// clears just the rows the last frame touched and allocates only when the
+// size changes.
+class MaskBitmap
+{
+public:
+  MaskBitmap() : width_(0), height_(0), words_(0), top_(0), bottom_(0) {}
+
+  void reset(int width, int height);
+
+  // ORs the nonzero pixels of a mono8 / 8UC1 mask within the box in, false
+  // if the encoding or size does not match
+  bool add(const sensor_msgs::Image &mask, int x, int y, int width, int height);
+  // this |= other and this &= ~other, a word at a time over the rows other
+  // touched, both the same size
+  void merge(const MaskBitmap &other);
+  void subtract(const MaskBitmap &other);
+
+  int width() const { return width_; }
+  int height() const { return height_; }
+  bool empty() const { return top_ >= bottom_; }
+  bool test(int u, int v) const { return (bits_[v * words_ + (u >> 6)] >> (u & 63)) & 1u; }
+
+  // f(v, u_begin, u_end) for every run of set pixels, row by row
+  template <typename F>
+  void for_each_run(F f) const
+  {
+    for (int v = top_; v < bottom_; ++v)
+    {
+      const uint64_t *row = &bits_[v * words_];
+      int begin = -1;
+      for (int w = 0; w < words_; ++w)
+      {
+        uint64_t word = row[w];
+        int offset = 0;
+        while (offset < 64)
+        {
+          // leading zeros end a pending run, leading ones extend it
+          uint64_t rest = word >> offset;
+          if (begin < 0)
+          {
+            if (!rest)
+              break;
+            offset += __builtin_ctzll(rest);
+            begin = w * 64 + offset;
+          }
+          else
+          {
+            uint64_t zeros = ~rest;
+            if (offset > 0)
+              zeros &= ~uint64_t(0) >> offset;
+            if (!zeros)
+              break;
+            offset += __builtin_ctzll(zeros);
+            f(v, begin, w * 64 + offset);
+            begin = -1;
+          }
+        }
+      }
+      if (begin >= 0)
+        f(v, begin, width_);
+    }
+  }
+
+private:
+  int width_, height_, words_;
+  // rows that may hold set bits
+  int top_, bottom_;
+  std::vector<uint64_t> bits_;
+};
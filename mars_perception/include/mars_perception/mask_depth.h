@@ -1,7 +1,4 @@
 #pragma once
-#include <message_filters/subscriber.h>
-#include <message_filters/sync_policies/approximate_time.h>
-#include <message_filters/synchronizer.h>
 #include <pcl/point_types.h>
 #include <pcl_conversions/pcl_conversions.h>
 #include <pcl_ros/point_cloud.h>
@@ -19,6 +16,7 @@
 #include <sensor_msgs/PointCloud2.h>
 #include <sensor_msgs/Image.h>
 #include <sensor_msgs/CameraInfo.h>
+#include <sensor_msgs/image_encodings.h>
 #include <tf/tf.h>
 #include <tf/transform_listener.h>
 #include <yaml-cpp/yaml.h>
@@ -26,10 +24,21 @@
 #include <cv_bridge/cv_bridge.h>
 #include <depth_image_proc/depth_traits.h>
 #include <image_geometry/pinhole_camera_model.h>
+#include <boost/asio/thread_pool.hpp>
+#include <boost/asio/post.hpp>
+#include <message_filters/subscriber.h>
+#include <message_filters/synchronizer.h>
+#include <message_filters/sync_policies/approximate_time.h>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <pcl/common/transforms.h>
+#include <mars_perception/extrinsics_cache.h>
+#include <mars_perception/ray_table.h>
+#include <mars_perception/mask_bitmap.h>
+#include <mars_perception/instance_label.h>
 
 
-#define CAM_CNT 3
-
 // for "rgb8"
 #define RGB8_RED_OFFSET 0
 #define RGB8_GREEN_OFFSET 1
@@ -40,46 +49,83 @@ class MaskDepth
 {
 
 public:
-    MaskDepth();
-    void convert();
+    MaskDepth(ros::NodeHandle &nh, ros::NodeHandle &pnh);
 
 private:
-    typedef pcl::PointXYZRGB PointT;
+    // label carries class and instance, see instance_label.h
+    typedef pcl::PointXYZRGBL PointT;
     typedef sensor_msgs::Image ImageT;
     typedef pcl::PointCloud<PointT> PointCloudT;
     typedef sensor_msgs::PointCloud2 PointCloudMsgT;
     typedef sensor_msgs::CameraInfo InfoT;
     typedef detectron2_ros::Result Result;
-    typedef message_filters::sync_policies::ApproximateTime<ImageT, ImageT, ImageT>
-        SyncPolicyT;
+    typedef message_filters::sync_policies::ApproximateTime<ImageT, ImageT, Result> BundlePolicy;
+
+    // pixels u_begin to u_end - 1 of row v belong to the labelled instance
+    struct PixelRun
+    {
+        int v;
+        int u_begin;
+        int u_end;
+        uint32_t label;
+    };
+
+    // depth, color and mask of one camera are matched by stamp and
+    // deprojected together as soon as the three are there
+    struct Camera
+    {
+        message_filters::Subscriber<ImageT> depth_sub;
+        message_filters::Subscriber<ImageT> color_sub;
+        message_filters::Subscriber<Result> mask_sub;
+        std::unique_ptr<message_filters::Synchronizer<BundlePolicy>> sync;
+        ros::Subscriber info_sub;
+        // replaced, never changed, when the intrinsics change. Only
+        // accessed through std::atomic_load / atomic_store
+        std::shared_ptr<const RayTable> rays;
+        // set while a bundle is deprojected on the pool, newer bundles of
+        // the same camera are dropped meanwhile
+        std::atomic<bool> busy;
+        // reused from bundle to bundle, only that camera's bundle uses them
+        // union of the kept instances, the one being decoded, and the
+        // runs of every instance minus the pixels of earlier ones
+        MaskBitmap mask;
+        MaskBitmap instance;
+        std::vector<PixelRun> runs;
+    };
 
     ros::NodeHandle nh_;
-    message_filters::Subscriber<ImageT> *depth_subs_[CAM_CNT];
-    message_filters::Synchronizer<SyncPolicyT> *depth_sync_;
-
-    message_filters::Subscriber<Result> *color_subs_[CAM_CNT];
-    message_filters::Synchronizer<SyncPolicyT> *color_sync_;
-
-    message_filters::Subscriber<CameraInfo> *info_subs_[CAM_CNT];
-    message_filters::Synchronizer<SyncPolicyT> *info_sync_;
-
-    message_filters::Subscriber<Result> *mask_subs_[CAM_CNT];
-    message_filters::Synchronizer<SyncPolicyT> *mask_sync_;
-
-    cv::Mat masks_[CAM_CNT];
-    ImageT masked_depth_[CAM_CNT];
-    ImageT masked_color_[CAM_CNT];
-    image_geometry::PinholeCameraModel models_[CAM_CNT];
-
-    XmlRpc::XmlRpcValue img_sizes_;
+    ros::NodeHandle pnh_;
+    size_t cam_cnt_;
+    std::vector<std::unique_ptr<Camera>> cameras_;
+    ros::Duration max_interval_;
+
+    // sparse deprojection walks only the runs of the mask bitmap and
+    // publishes masked points only, dense deprojection walks whole frames
+    // into organized clouds with NaN outside the mask
+    bool sparse_;
+
+    // bundles are deprojected on this pool when worker_threads > 1
+    int worker_threads_;
+    std::unique_ptr<boost::asio::thread_pool> worker_pool_;
+
+    // newest deprojected cloud of every camera, published together once
+    // all of them lie within max_interval_. A camera whose last bundle is
+    // more than camera_timeout_ older than the newest one, or that never
+    // sent one, is left out instead of holding back the others.
+    std::mutex merge_mutex_;
+    std::vector<PointCloudT::Ptr> camera_clouds_;
+    std::vector<std_msgs::Header> camera_headers_;
+    ros::Duration camera_timeout_;
+
+    std::vector<std::string> detect_names_;
 
-    ros::Subscriber config_subscriber_;
     ros::Publisher cloud_publisher_;
     tf::TransformListener tf_listener_;
+    std::unique_ptr<ExtrinsicsCache> extrinsics_;
 
-    XmlRpc::XmlRpcValue leaf_sizes_;
     std::vector<double> box_min_, box_max_;
 
+    bool icp_enabled_;
     double max_corresp_dist_;
     double transf_epsilon_;
     double fitness_epsilon_;
@@ -88,14 +134,25 @@ private:
 
     std::string base_frame_id_;
 
-    PointCloudT::Ptr concat_masked_cloud_;
-
-    void depth_image_cb(const ImageT::ConstPtr &msg1, const ImageT::ConstPtr &msg2, const ImageT::ConstPtr &msg3);
-    void color_image_cb(const ImageT::ConstPtr &msg1, const ImageT::ConstPtr &msg2, const ImageT::ConstPtr &msg3);
-    void info_cb(const InfoT::ConstPtr &msg1, const InfoT::ConstPtr &msg2, const InfoT::ConstPtr &msg3);
-    void mask_cb(const Result::ConstPtr &msg1, const Result::ConstPtr &msg2, const Result::ConstPtr &msg3);
-    void depth_to_pointcloud(const sensor_msgs::ImageConstPtr& depth_msg,
-                                        const sensor_msgs::ImageConstPtr& rgb_msg,
-                                        const PointCloud::Ptr& cloud_msg,
-                                        const image_geometry::PinholeModel&);
-};
\ No newline at end of file
+    void bundle_cb(size_t i, const ImageT::ConstPtr &depth, const ImageT::ConstPtr &color, const Result::ConstPtr &mask);
+    void info_cb(size_t i, const InfoT::ConstPtr &msg);
+    void process_bundle(size_t i, const RayTable &rays, const ImageT::ConstPtr &depth, const ImageT::ConstPtr &color,
+                        const Result::ConstPtr &mask);
+    bool deproject_camera(size_t i, const RayTable &rays, const ImageT::ConstPtr &depth,
+                          const ImageT::ConstPtr &color, const Result::ConstPtr &mask, const PointCloudT::Ptr &cloud);
+    void merge(size_t i, const std_msgs::Header &header, const PointCloudT::Ptr &cloud);
+    void decode_mask(size_t i, const Result::ConstPtr &msg, int width, int height);
+
+    template <typename T>
+    void depth_to_pointcloud(const ImageT::ConstPtr &depth_msg,
+                             const ImageT::ConstPtr &rgb_msg,
+                             const MaskBitmap &mask,
+                             const PointCloudT::Ptr &cloud,
+                             const RayTable &rays);
+    template <typename T>
+    void runs_to_pointcloud(const ImageT::ConstPtr &depth_msg,
+                            const ImageT::ConstPtr &rgb_msg,
+                            const std::vector<PixelRun> &runs,
+                            const PointCloudT::Ptr &cloud,
+                            const RayTable &rays);
+};
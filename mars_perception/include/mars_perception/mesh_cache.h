@@ -0,0 +1,92 @@
+#pragma once
+#include <ros/ros.h>
+#include <pcl/point_types.h>
+#include <pcl/point_cloud.h>
+#include <pcl/io/vtk_lib_io.h>
+#include <boost/asio/thread_pool.hpp>
+#include <boost/asio/post.hpp>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <map>
+#include <string>
+#include <vector>
+#include <ctime>
+
+// How a mesh surface becomes model points. With points the model gets that
+// many evenly spaced points, with spacing (meters) points no closer than
+// that. Neither keeps the dense sampling voxelized at 1 mm.
+struct MeshSampling
+{
+  int points = 0;
+  double spacing = 0.0;
+
+  bool operator==(const MeshSampling &other) const { return points == other.points && spacing == other.spacing; }
+};
+
+// Sampled model cloud of one mesh, in meters and centered on its centroid.
+// Models are shared between callers and never modified after loading.
+struct MeshModel
+{
+  typedef pcl::PointXYZRGB PointT;
+  typedef pcl::PointXYZRGBNormal PointNormalT;
+
+  std::string name;
+  std::string path;
+  std::time_t mtime;
+  pcl::PointCloud<PointT>::ConstPtr cloud;
+  pcl::PointCloud<PointNormalT>::ConstPtr cloud_normals;
+};
+typedef std::shared_ptr<const MeshModel> MeshModelConstPtr;
+
+// Mesh name -> sampled model, keyed on the STL path, sampling and
+// modification time. A mesh param is either the STL path or a map with
+// path and optionally points or spacing, see MeshSampling.
+// Sampled clouds are also written as binary PCDs under cache_dir, so a
+// restart only reads a small file instead of sampling the STL again. An
+// empty cache_dir keeps the cache in memory only.
+class MeshCache
+{
+public:
+  typedef std::function<void(const MeshModelConstPtr &)> LoadedCallback;
+
+  MeshCache(ros::NodeHandle &nh, const std::string &cache_dir, int threads);
+  ~MeshCache();
+
+  // blocks until the model is ready, returns null if the mesh is unknown
+  // or cannot be loaded
+  MeshModelConstPtr get(const std::string &name);
+
+  // starts loading every mesh in the background and returns immediately.
+  // on_loaded runs on the loader thread once a model is ready.
+  void preload(const std::vector<std::string> &names, const LoadedCallback &on_loaded = LoadedCallback());
+
+  // samples an STL in millimeters into a centered cloud in meters
+  static bool sample_stl(const std::string &path, pcl::PointCloud<MeshModel::PointNormalT> &cloud,
+                         const MeshSampling &sampling = MeshSampling());
+
+private:
+  struct Entry
+  {
+    std::string path;
+    MeshSampling sampling;
+    std::time_t mtime;
+    std::shared_future<MeshModelConstPtr> model;
+  };
+
+  ros::NodeHandle nh_;
+  std::string cache_dir_;
+  std::unique_ptr<boost::asio::thread_pool> pool_;
+
+  std::mutex mutex_;
+  std::map<std::string, Entry> entries_;
+
+  std::shared_future<MeshModelConstPtr> request_(const std::string &name, bool async,
+                                                const LoadedCallback &on_loaded = LoadedCallback());
+  bool read_param_(const std::string &name, std::string &path, MeshSampling &sampling) const;
+  MeshModelConstPtr load_(const std::string &name, const std::string &path, const MeshSampling &sampling,
+                          std::time_t mtime);
+  std::string cache_file_(const std::string &name, const std::string &path, const MeshSampling &sampling,
+                          std::time_t mtime) const;
+};
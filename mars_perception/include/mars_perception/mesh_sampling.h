@@ -1,3 +1,4 @@
+#pragma once
 #include <pcl/io/pcd_io.h>
 #include <pcl/io/vtk_lib_io.h>
 #include <vtkVersion.h>
@@ -5,7 +6,6 @@
 #include <vtkOBJReader.h>
 #include <vtkTriangle.h>
 #include <vtkTriangleFilter.h>
-#include <vtkPolyDataMapper.h>
 #include <pcl/filters/voxel_grid.h>
 #include <pcl/console/print.h>
 #include <pcl/console/parse.h>
@@ -18,4 +18,46 @@
   using vtkCellPtsPtr = vtkIdType*;
 #endif
 
-void polygon_mesh_to_pc(pcl::PolygonMesh *mesh_ptr, pcl::PointCloud<pcl::PointXYZRGB>::Ptr pc_ptr);
\ No newline at end of file
+#include <mars_perception/stl_reader.h>
+#include <Eigen/Dense>
+#include <cstdint>
+#include <vector>
+
+void triangles_from_polydata(vtkPolyData *polydata, TriangleList &triangles);
+
+// Area weighted random points on a triangle surface. An alias table picks
+// the triangle in constant time, normals are the face normals. The same
+// seed gives the same cloud for any thread count, threads 0 uses every core.
+class SurfaceSampler
+{
+public:
+  explicit SurfaceSampler(const TriangleList &triangles);
+
+  void sample(std::size_t n_samples, std::uint64_t seed, int threads,
+              pcl::PointCloud<pcl::PointXYZRGBNormal> &cloud_out) const;
+  double area() const { return area_; }
+
+private:
+  TriangleList triangles_;
+  std::vector<Eigen::Vector3f> normals_;
+  std::vector<float> prob_;
+  std::vector<std::uint32_t> alias_;
+  double area_;
+};
+
+// Samples the triangles into a voxelized cloud in the mesh's own units.
+// Normals are kept, scaling and centering are left to the caller.
+void triangles_to_pc(const TriangleList &triangles, pcl::PointCloud<pcl::PointXYZRGBNormal> &pc,
+                     std::size_t n_samples = 100000, std::uint64_t seed = 0, int threads = 0);
+
+// Evenly spaced surface points in the mesh's units, normals from the
+// faces. With n_points > 0 exactly that many, left by weighted sample
+// elimination (Yuksel 2015) from five times as many random samples.
+// Otherwise random samples are kept when no kept point is closer than
+// spacing (dart throwing), which saturates the surface.
+void poisson_disk_to_pc(const TriangleList &triangles, pcl::PointCloud<pcl::PointXYZRGBNormal> &pc, double spacing,
+                        std::size_t n_points, std::uint64_t seed = 0, int threads = 0);
+
+// the same for a PCL mesh, triangulated through VTK first
+void polygon_mesh_to_pc(pcl::PolygonMesh *mesh_ptr, pcl::PointCloud<pcl::PointXYZRGBNormal>::Ptr pc_ptr,
+                        std::size_t n_samples = 100000, std::uint64_t seed = 0, int threads = 0);
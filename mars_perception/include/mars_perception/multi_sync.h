@@ -0,0 +1,105 @@
+#pragma once
+#include <ros/ros.h>
+#include <ros/message_traits.h>
+#include <boost/function.hpp>
+#include <boost/bind.hpp>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Approximate time synchronizer over a topic list whose length is only known
+// at startup. message_filters fixes the input count at compile time; this
+// matches one message per topic whose stamps lie within max_interval and
+// hands them to the callback in topic order.
+template <typename M>
+class MultiSynchronizer
+{
+public:
+  typedef typename M::ConstPtr MsgConstPtr;
+  typedef boost::function<void(const std::vector<MsgConstPtr> &)> Callback;
+
+  MultiSynchronizer(ros::NodeHandle &nh, const std::vector<std::string> &topics, uint32_t queue_size,
+                    const ros::Duration &max_interval, const Callback &cb)
+      : queue_size_(std::max(queue_size, 1u)), max_interval_(max_interval), cb_(cb), queues_(topics.size())
+  {
+    for (size_t i = 0; i < topics.size(); ++i)
+    {
+      subs_.push_back(nh.subscribe<M>(topics[i], queue_size_,
+                                      boost::bind(&MultiSynchronizer::msg_cb_, this, i, _1)));
+    }
+  }
+
+  size_t size() const { return queues_.size(); }
+
+private:
+  uint32_t queue_size_;
+  ros::Duration max_interval_;
+  Callback cb_;
+
+  std::mutex mutex_;
+  std::vector<ros::Subscriber> subs_;
+  std::vector<std::deque<MsgConstPtr>> queues_;
+
+  static ros::Time stamp_(const MsgConstPtr &msg)
+  {
+    return ros::message_traits::TimeStamp<M>::value(*msg);
+  }
+
+  void msg_cb_(size_t i, const MsgConstPtr &msg)
+  {
+    std::vector<MsgConstPtr> matched;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      queues_[i].push_back(msg);
+      if (queues_[i].size() > queue_size_)
+        queues_[i].pop_front();
+      if (!match_(matched))
+        return;
+    }
+    cb_(matched);
+  }
+
+  bool match_(std::vector<MsgConstPtr> &matched)
+  {
+    while (true)
+    {
+      ros::Time pivot;
+      for (const auto &q : queues_)
+      {
+        if (q.empty())
+          return false;
+        pivot = std::max(pivot, stamp_(q.front()));
+      }
+
+      // move every topic to its newest message that is not after the pivot
+      ros::Time oldest = pivot;
+      size_t oldest_i = 0;
+      for (size_t i = 0; i < queues_.size(); ++i)
+      {
+        auto &q = queues_[i];
+        while (q.size() > 1 && stamp_(q[1]) <= pivot)
+          q.pop_front();
+        if (stamp_(q.front()) < oldest)
+        {
+          oldest = stamp_(q.front());
+          oldest_i = i;
+        }
+      }
+
+      if (pivot - oldest <= max_interval_)
+      {
+        matched.clear();
+        for (auto &q : queues_)
+        {
+          matched.push_back(q.front());
+          q.pop_front();
+        }
+        return true;
+      }
+
+      // the oldest head can never be matched, drop it and retry
+      queues_[oldest_i].pop_front();
+    }
+  }
+};
@@ -0,0 +1,37 @@
+#pragma once
+#include <image_geometry/pinhole_camera_model.h>
+#include <cstdint>
+#include <vector>
+
+// Deprojection factors of a pinhole camera: x / z only depends on the
+// column and y / z only on the row, so a frame needs one table entry per
+// column and per row instead of a subtraction and multiply per pixel.
+// update() rebuilds them only when the intrinsics or size change.
+class RayTable
+{
+public:
+  RayTable() : width_(0), height_(0), fx_(0.0), fy_(0.0), cx_(0.0), cy_(0.0) {}
+
+  // true when the table was rebuilt
+  bool update(const image_geometry::PinholeCameraModel &model);
+  bool update(int width, int height, double fx, double fy, double cx, double cy);
+
+  int width() const { return width_; }
+  int height() const { return height_; }
+  const float *x() const { return x_.data(); }
+  float y(int v) const { return y_[v]; }
+
+private:
+  int width_, height_;
+  double fx_, fy_, cx_, cy_;
+  std::vector<float> x_, y_;
+};
+
+// Columns u_begin to u_end - 1 of depth row v into xyz, three floats per
+// pixel starting with u_begin, depth_scale converts depth units to meters.
+// Zero depth gives NaN. The 16 bit version is written for the compiler to
+// vectorize, the float one is the reference for 32FC1 frames.
+void deproject_row(const RayTable &rays, const uint16_t *depth, int v, int u_begin, int u_end, float depth_scale,
+                   float *xyz);
+void deproject_row(const RayTable &rays, const float *depth, int v, int u_begin, int u_end, float depth_scale,
+                   float *xyz);
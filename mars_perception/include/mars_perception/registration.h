@@ -14,9 +14,6 @@
  * limitations under the License.
  */
 #pragma once
-#include <message_filters/subscriber.h>
-#include <message_filters/sync_policies/approximate_time.h>
-#include <message_filters/synchronizer.h>
 #include <pcl/point_types.h>
 #include <pcl_conversions/pcl_conversions.h>
 #include <pcl_ros/point_cloud.h>
@@ -29,6 +26,7 @@
 #include <pcl/sample_consensus/model_types.h>
 #include <pcl/segmentation/sac_segmentation.h>
 #include <pcl/registration/icp.h>
+#include <pcl/search/kdtree.h>
 
 #include <pcl_ros/transforms.h>
 #include <ros/ros.h>
@@ -36,24 +34,31 @@
 #include <tf/tf.h>
 #include <tf/transform_listener.h>
 #include <yaml-cpp/yaml.h>
+#include <pcl/common/transforms.h>
+#include <mars_perception/extrinsics_cache.h>
+#include <mars_perception/fused_filter.h>
+#include <mars_perception/multi_sync.h>
+#include <mars_perception/voxel_hash.h>
+#include <boost/asio/thread_pool.hpp>
+#include <boost/asio/post.hpp>
+#include <future>
+#include <functional>
 
-#define CAM_CNT 3
 class PCRegistration
 {
 public:
   typedef pcl::PointXYZRGB PointT;
   typedef pcl::PointCloud<PointT> PointCloudT;
   typedef sensor_msgs::PointCloud2 PointCloudMsgT;
-  typedef message_filters::sync_policies::ApproximateTime<PointCloudMsgT, PointCloudMsgT, PointCloudMsgT>
-      SyncPolicyT;
-  PCRegistration();
+  PCRegistration(ros::NodeHandle &nh, ros::NodeHandle &pnh);
 
   PointCloudT::Ptr cloud_concatenated;
 
 private:
   ros::NodeHandle nh_;
-  message_filters::Subscriber<PointCloudMsgT> *cloud_subscribers_[CAM_CNT];
-  message_filters::Synchronizer<SyncPolicyT> *cloud_synchronizer_;
+  ros::NodeHandle pnh_;
+  size_t cam_cnt_;
+  std::unique_ptr<MultiSynchronizer<PointCloudMsgT>> cloud_synchronizer_;
   ros::Subscriber config_subscriber_;
   ros::Publisher cloud_publisher_;
   tf::TransformListener tf_listener_;
@@ -64,14 +69,31 @@ private:
   bool box_enabled_;
   std::vector<double> box_min_, box_max_;
 
+  // "pcl" runs CropBox + VoxelGrid, "fused" runs one FusedCloudFilter per camera
+  std::string filter_mode_;
+  std::vector<FusedCloudFilter, Eigen::aligned_allocator<FusedCloudFilter>> fused_filters_;
+
   double max_corresp_dist_;
   double transf_epsilon_;
   double fitness_epsilon_;
   double max_iter_;
   double reject_thres_;
   bool icp_enabled_;
+  // voxel hash cell for the correspondences against camera 0, 0 uses a KD-tree
+  double hash_cell_;
 
   std::string base_frame_id_;
+  std::unique_ptr<ExtrinsicsCache> extrinsics_;
+
+  // per-camera stages run on this pool when worker_threads > 1,
+  // worker_threads <= 0 sizes it to the camera count
+  int worker_threads_;
+  std::unique_ptr<boost::asio::thread_pool> worker_pool_;
 
-  void pointcloud_callback(const PointCloudMsgT::ConstPtr &msg1, const PointCloudMsgT::ConstPtr &msg2, const PointCloudMsgT::ConstPtr &msg3);
+  void pointcloud_callback(const std::vector<PointCloudMsgT::ConstPtr> &msgs);
+  void preprocess_cloud(const PointCloudMsgT::ConstPtr &msg, size_t i, PointCloudT::Ptr &cloud);
+  // target_hash or else target_tree has to be built over target
+  void align_cloud(const PointCloudT::Ptr &target, const VoxelHash::ConstPtr &target_hash,
+                   const pcl::search::KdTree<PointT>::Ptr &target_tree, const PointCloudT::Ptr &cloud);
+  void for_each_camera(const std::function<void(size_t)> &stage);
 };
\ No newline at end of file
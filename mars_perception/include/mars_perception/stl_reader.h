@@ -0,0 +1,35 @@
+#pragma once
+#include <Eigen/Dense>
+#include <cstddef>
+#include <string>
+#include <vector>
+
+// Triangles with one float array per corner coordinate: corner k of
+// triangle t is (x[k][t], y[k][t], z[k][t]).
+struct TriangleList
+{
+  std::vector<float> x[3], y[3], z[3];
+
+  std::size_t size() const { return x[0].size(); }
+  void resize(std::size_t n)
+  {
+    for (int k = 0; k < 3; ++k)
+    {
+      x[k].resize(n);
+      y[k].resize(n);
+      z[k].resize(n);
+    }
+  }
+  Eigen::Vector3f corner(std::size_t t, int k) const { return Eigen::Vector3f(x[k][t], y[k][t], z[k][t]); }
+  void set_corner(std::size_t t, int k, float cx, float cy, float cz)
+  {
+    x[k][t] = cx;
+    y[k][t] = cy;
+    z[k][t] = cz;
+  }
+};
+
+// Reads a binary or ASCII STL straight into triangles, in file units. With
+// use_mmap the file is mapped instead of read into a buffer first. Facet
+// normals are dropped, they follow from the corner order.
+bool read_stl(const std::string &path, TriangleList &triangles, bool use_mmap = true);
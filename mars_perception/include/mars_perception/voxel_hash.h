@@ -0,0 +1,157 @@
+#pragma once
+#include <pcl/point_types.h>
+#include <pcl/point_cloud.h>
+#include <pcl/common/point_tests.h>
+#include <pcl/registration/correspondence_estimation.h>
+#include <Eigen/Dense>
+#include <cstdint>
+#include <limits>
+#include <memory>
+#include <vector>
+
+// Bounded radius nearest neighbour search over a fixed cloud. Points are
+// sorted by the cubic cell they fall in and stored per coordinate, cells
+// are found through a flat open addressing table, and a query scans rings
+// of cells outwards from its own until no closer point can exist. Building
+// is one sort, so it pays off on clouds that change every frame.
+// Read only after construction, queries may run from any number of threads.
+class VoxelHash
+{
+public:
+  typedef std::shared_ptr<const VoxelHash> ConstPtr;
+
+  // non finite points are left out, indices still refer to cloud
+  template <typename PointT>
+  VoxelHash(const pcl::PointCloud<PointT> &cloud, float cell_size)
+  {
+    std::vector<Eigen::Vector3f> points;
+    std::vector<int> indices;
+    points.reserve(cloud.size());
+    indices.reserve(cloud.size());
+    for (size_t i = 0; i < cloud.size(); ++i)
+    {
+      if (!pcl::isFinite(cloud.points[i]))
+        continue;
+      points.push_back(cloud.points[i].getVector3fMap());
+      indices.push_back(static_cast<int>(i));
+    }
+    build_(points, indices, cell_size);
+  }
+
+  // cloud index of the closest point with a squared distance below
+  // max_sqr_dist, -1 if there is none
+  int nearest(const Eigen::Vector3f &p, float max_sqr_dist, float &sqr_dist) const;
+
+  size_t size() const { return index_.size(); }
+  float cell_size() const { return cell_; }
+
+  // a query scans about radius / cell rings of cells, past a few the
+  // ring volume grows faster than a KD-tree's descent, so wide searches
+  // like coarse ICP levels are left to the tree
+  static bool suits(double cell_size, double max_distance) { return max_distance <= 4.0 * cell_size; }
+
+private:
+  struct Cell
+  {
+    uint64_t key;
+    uint32_t begin;
+    uint32_t end;
+  };
+
+  float cell_;
+  float inv_cell_;
+  // points in cell order, one array per coordinate so the distance loop
+  // over a cell runs on contiguous floats
+  std::vector<float> x_, y_, z_;
+  std::vector<int> index_;
+  std::vector<Cell> table_;
+  int shift_;
+  Eigen::Vector3i min_cell_, max_cell_;
+
+  void build_(const std::vector<Eigen::Vector3f> &points, const std::vector<int> &indices, float cell_size);
+  const Cell *find_(const Eigen::Vector3i &c) const;
+};
+
+// Correspondence estimation for PCL's ICP classes backed by a VoxelHash
+// over the target, which is built by the caller and may be shared by
+// several registrations. The source points are matched on threads OpenMP
+// threads. Pass the ICP an empty search tree with force_no_recompute so it
+// does not build its own.
+template <typename PointSource, typename PointTarget>
+class VoxelHashCorrespondence : public pcl::registration::CorrespondenceEstimationBase<PointSource, PointTarget, float>
+{
+public:
+  typedef pcl::registration::CorrespondenceEstimationBase<PointSource, PointTarget, float> Base;
+
+  explicit VoxelHashCorrespondence(const VoxelHash::ConstPtr &hash, int threads = 1) : hash_(hash), threads_(threads)
+  {
+    Base::corr_name_ = "VoxelHashCorrespondence";
+  }
+
+  void determineCorrespondences(pcl::Correspondences &correspondences,
+                                double max_distance = std::numeric_limits<double>::max()) override
+  {
+    if (!pcl::PCLBase<PointSource>::initCompute())
+      return;
+    match_(*hash_, max_distance, correspondences);
+    pcl::PCLBase<PointSource>::deinitCompute();
+  }
+
+  // keeps the matches whose target point has its source point as nearest
+  // neighbour in turn, through a second hash over the source
+  void determineReciprocalCorrespondences(pcl::Correspondences &correspondences,
+                                          double max_distance = std::numeric_limits<double>::max()) override
+  {
+    if (!pcl::PCLBase<PointSource>::initCompute())
+      return;
+    pcl::Correspondences forward;
+    match_(*hash_, max_distance, forward);
+    VoxelHash source_hash(*this->input_, hash_->cell_size());
+    const float max_sqr = max_sqr_(max_distance);
+    correspondences.clear();
+    correspondences.reserve(forward.size());
+    for (const pcl::Correspondence &c : forward)
+    {
+      float sqr_dist;
+      const PointTarget &t = (*this->target_)[c.index_match];
+      if (source_hash.nearest(t.getVector3fMap(), max_sqr, sqr_dist) == c.index_query)
+        correspondences.push_back(c);
+    }
+    pcl::PCLBase<PointSource>::deinitCompute();
+  }
+
+  typename Base::Ptr clone() const override { return typename Base::Ptr(new VoxelHashCorrespondence(*this)); }
+
+private:
+  VoxelHash::ConstPtr hash_;
+  int threads_;
+
+  static float max_sqr_(double max_distance)
+  {
+    double sqr = max_distance * max_distance;
+    return sqr < std::numeric_limits<float>::max() ? static_cast<float>(sqr) : std::numeric_limits<float>::max();
+  }
+
+  void match_(const VoxelHash &hash, double max_distance, pcl::Correspondences &correspondences) const
+  {
+    const std::vector<int> &indices = *this->indices_;
+    const float max_sqr = max_sqr_(max_distance);
+    std::vector<pcl::Correspondence> found(indices.size());
+#pragma omp parallel for num_threads(threads_) schedule(static, 256) if (threads_ > 1)
+    for (int i = 0; i < static_cast<int>(indices.size()); ++i)
+    {
+      const PointSource &p = (*this->input_)[indices[i]];
+      float sqr_dist = 0.0f;
+      int match = pcl::isFinite(p) ? hash.nearest(p.getVector3fMap(), max_sqr, sqr_dist) : -1;
+      found[i] = pcl::Correspondence(indices[i], match, sqr_dist);
+    }
+
+    correspondences.clear();
+    correspondences.reserve(found.size());
+    for (const pcl::Correspondence &c : found)
+    {
+      if (c.index_match >= 0)
+        correspondences.push_back(c);
+    }
+  }
+};
@@ -0,0 +1,134 @@
+#include <mars_perception/voxel_hash.h>
+#include <pcl/io/pcd_io.h>
+#include <pcl/common/transforms.h>
+#include <pcl/registration/icp.h>
+#include <pcl/search/kdtree.h>
+#include <chrono>
+#include <random>
+#include <thread>
+#include <iostream>
+
+// Compares PCL's KD-tree correspondence estimation with VoxelHashCorrespondence
+// on a recorded scene cloud, e.g. one saved from /filtered_masked_points with
+// pcl_ros pointcloud_to_pcd. The source is the scene moved by a few mm and
+// degrees with sensor noise, like ICP after its first iterations. Prints
+// build and search time, how many matches differ, and a full ICP run with
+// each backend.
+//   correspondence_benchmark <scene.pcd> [max_distance] [cell] [runs]
+
+typedef pcl::PointXYZRGB PointT;
+typedef pcl::PointCloud<PointT> PointCloudT;
+typedef pcl::search::KdTree<PointT> SearchTree;
+
+template <typename F>
+static double time_ms(int iterations, F f)
+{
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < iterations; ++i)
+    f();
+  auto end = std::chrono::steady_clock::now();
+  return std::chrono::duration<double, std::milli>(end - start).count() / iterations;
+}
+
+int main(int argc, char **argv)
+{
+  if (argc < 2)
+  {
+    std::cerr << "usage: correspondence_benchmark <scene.pcd> [max_distance] [cell] [runs]\n";
+    return 1;
+  }
+  double max_distance = argc > 2 ? std::atof(argv[2]) : 0.01;
+  float cell = argc > 3 ? std::atof(argv[3]) : 0.003f;
+  int iterations = argc > 4 ? std::atoi(argv[4]) : 10;
+
+  PointCloudT::Ptr target(new PointCloudT);
+  if (pcl::io::loadPCDFile(argv[1], *target) < 0)
+  {
+    std::cerr << "cannot load " << argv[1] << "\n";
+    return 1;
+  }
+  PointCloudT::Ptr source(new PointCloudT);
+  Eigen::Affine3f motion = Eigen::Translation3f(0.003f, -0.002f, 0.001f) *
+                           Eigen::AngleAxisf(0.02f, Eigen::Vector3f(0.3f, 0.2f, 1.0f).normalized());
+  pcl::transformPointCloud(*target, *source, motion.matrix());
+  std::mt19937 rng(0);
+  std::normal_distribution<float> noise(0.0f, 0.001f);
+  for (auto &p : source->points)
+  {
+    p.x += noise(rng);
+    p.y += noise(rng);
+    p.z += noise(rng);
+  }
+  std::cout << target->size() << " points, max_distance " << max_distance << ", cell " << cell << "\n";
+
+  // building, every scene frame needs a new one
+  SearchTree::Ptr tree;
+  VoxelHash::ConstPtr hash;
+  double tree_build = time_ms(iterations, [&]() {
+    tree.reset(new SearchTree);
+    tree->setInputCloud(target);
+  });
+  double hash_build = time_ms(iterations, [&]() { hash = std::make_shared<VoxelHash>(*target, cell); });
+
+  // one correspondence pass, what every ICP iteration runs
+  pcl::Correspondences tree_matches, hash_matches;
+  pcl::registration::CorrespondenceEstimation<PointT, PointT> kd_estimation;
+  kd_estimation.setInputSource(source);
+  kd_estimation.setInputTarget(target);
+  kd_estimation.setSearchMethodTarget(tree, true);
+  double tree_search = time_ms(iterations, [&]() { kd_estimation.determineCorrespondences(tree_matches, max_distance); });
+
+  int threads = std::max(1u, std::thread::hardware_concurrency());
+  std::vector<double> hash_search;
+  for (int t : {1, threads})
+  {
+    VoxelHashCorrespondence<PointT, PointT> hash_estimation(hash, t);
+    hash_estimation.setInputSource(source);
+    hash_estimation.setInputTarget(target);
+    hash_search.push_back(
+        time_ms(iterations, [&]() { hash_estimation.determineCorrespondences(hash_matches, max_distance); }));
+  }
+
+  // both return the nearest point, ties aside they must agree
+  size_t differ = 0;
+  std::vector<float> tree_dist(source->size(), -1.0f);
+  for (const auto &c : tree_matches)
+    tree_dist[c.index_query] = c.distance;
+  for (const auto &c : hash_matches)
+  {
+    if (std::abs(tree_dist[c.index_query] - c.distance) > 1e-9f)
+      ++differ;
+  }
+
+  std::cout << "kd-tree:    build " << tree_build << " ms, search " << tree_search << " ms, " << tree_matches.size()
+            << " matches\n";
+  std::cout << "voxel hash: build " << hash_build << " ms, search " << hash_search[0] << " ms (1 thread), "
+            << hash_search[1] << " ms (" << threads << " threads), " << hash_matches.size() << " matches, "
+            << differ << " differ\n";
+
+  // whole ICP, 20 iterations at most, including the target build
+  for (bool use_hash : {false, true})
+  {
+    Eigen::Matrix4f tf;
+    double ms = time_ms(iterations, [&]() {
+      pcl::IterativeClosestPoint<PointT, PointT> icp;
+      icp.setInputSource(source);
+      icp.setInputTarget(target);
+      if (use_hash)
+      {
+        icp.setCorrespondenceEstimation(pcl::IterativeClosestPoint<PointT, PointT>::CorrespondenceEstimationPtr(
+            new VoxelHashCorrespondence<PointT, PointT>(std::make_shared<VoxelHash>(*target, cell))));
+        icp.setSearchMethodTarget(SearchTree::Ptr(new SearchTree), true);
+      }
+      icp.setMaxCorrespondenceDistance(max_distance);
+      icp.setMaximumIterations(20);
+      PointCloudT aligned;
+      icp.align(aligned);
+      tf = icp.getFinalTransformation();
+    });
+    Eigen::Matrix4f delta = motion.matrix() * tf;
+    std::cout << (use_hash ? "ICP voxel hash: " : "ICP kd-tree:    ") << ms << " ms, residual "
+              << delta.block<3, 1>(0, 3).norm() * 1000.0 << " mm\n";
+  }
+  return 0;
+}
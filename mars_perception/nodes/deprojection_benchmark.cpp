@@ -0,0 +1,163 @@
+#include <mars_perception/ray_table.h>
+#include <pcl/point_types.h>
+#include <pcl/point_cloud.h>
+#include <chrono>
+#include <cmath>
+#include <iostream>
+#include <limits>
+#include <vector>
+
+// Deprojects a synthetic 16UC1 depth frame at D455 (1280x720) and D405
+// (848x480) resolution the way MaskDepth used to, per pixel from the
+// intrinsics, through a RayTable inline, and through deproject_row alone
+// and packed into a colored cloud. Also checks they give the same points.
+//   deprojection_benchmark [runs]
+
+typedef pcl::PointXYZRGB PointT;
+typedef pcl::PointCloud<PointT> PointCloudT;
+
+struct Camera
+{
+  const char *name;
+  int width, height;
+  float fx, fy, cx, cy;
+};
+
+template <typename F>
+static double time_ms(int iterations, F f)
+{
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < iterations; ++i)
+    f();
+  auto end = std::chrono::steady_clock::now();
+  return std::chrono::duration<double, std::milli>(end - start).count() / iterations;
+}
+
+int main(int argc, char **argv)
+{
+  int iterations = argc > 1 ? std::atoi(argv[1]) : 50;
+  const Camera cameras[] = {{"D455", 1280, 720, 640.0f, 640.0f, 640.5f, 360.5f},
+                            {"D405", 848, 480, 425.0f, 425.0f, 424.5f, 240.5f}};
+
+  for (const Camera &cam : cameras)
+  {
+    // table at ~0.8 m in mm, with a few missing returns
+    std::vector<uint16_t> depth(cam.width * cam.height);
+    std::vector<uint8_t> rgb(3 * depth.size());
+    for (int v = 0; v < cam.height; ++v)
+    {
+      for (int u = 0; u < cam.width; ++u)
+      {
+        int i = v * cam.width + u;
+        depth[i] = (u * 7 + v * 13) % 97 == 0 ? 0 : uint16_t(800 + 100 * std::sin(u * 0.01f) * std::cos(v * 0.01f));
+        rgb[3 * i] = u % 256;
+        rgb[3 * i + 1] = v % 256;
+        rgb[3 * i + 2] = 128;
+      }
+    }
+
+    PointCloudT reference(cam.width, cam.height);
+    double reference_ms = time_ms(iterations, [&]() {
+      float constant_x = 0.001f / cam.fx;
+      float constant_y = 0.001f / cam.fy;
+      PointCloudT::iterator pt = reference.begin();
+      for (int v = 0; v < cam.height; ++v)
+      {
+        for (int u = 0; u < cam.width; ++u, ++pt)
+        {
+          uint16_t d = depth[v * cam.width + u];
+          if (d == 0)
+          {
+            pt->x = pt->y = pt->z = std::numeric_limits<float>::quiet_NaN();
+          }
+          else
+          {
+            pt->x = (u - cam.cx) * d * constant_x;
+            pt->y = (v - cam.cy) * d * constant_y;
+            pt->z = d * 0.001f;
+          }
+          const uint8_t *c = &rgb[3 * (v * cam.width + u)];
+          pt->a = 255;
+          pt->r = c[0];
+          pt->g = c[1];
+          pt->b = c[2];
+        }
+      }
+    });
+
+    RayTable rays;
+    double table_ms = time_ms(iterations, [&]() {
+      rays = RayTable();
+      rays.update(cam.width, cam.height, cam.fx, cam.fy, cam.cx, cam.cy);
+    });
+
+    // the table straight into the cloud, what a dense MaskDepth frame does
+    PointCloudT direct(cam.width, cam.height);
+    double direct_ms = time_ms(iterations, [&]() {
+      const float *ray_x = rays.x();
+      PointCloudT::iterator pt = direct.begin();
+      for (int v = 0; v < cam.height; ++v)
+      {
+        const float ray_y = rays.y(v);
+        for (int u = 0; u < cam.width; ++u, ++pt)
+        {
+          uint16_t d = depth[v * cam.width + u];
+          float z = d ? d * 0.001f : std::numeric_limits<float>::quiet_NaN();
+          pt->x = ray_x[u] * z;
+          pt->y = ray_y * z;
+          pt->z = z;
+          const uint8_t *c = &rgb[3 * (v * cam.width + u)];
+          pt->a = 255;
+          pt->r = c[0];
+          pt->g = c[1];
+          pt->b = c[2];
+        }
+      }
+    });
+
+    std::vector<float> xyz(3 * depth.size());
+    double kernel_ms = time_ms(iterations, [&]() {
+      for (int v = 0; v < cam.height; ++v)
+        deproject_row(rays, &depth[v * cam.width], v, 0, cam.width, 0.001f, &xyz[3 * v * cam.width]);
+    });
+
+    PointCloudT packed(cam.width, cam.height);
+    double packed_ms = time_ms(iterations, [&]() {
+      std::vector<float> row(3 * cam.width);
+      PointCloudT::iterator pt = packed.begin();
+      for (int v = 0; v < cam.height; ++v)
+      {
+        deproject_row(rays, &depth[v * cam.width], v, 0, cam.width, 0.001f, row.data());
+        const float *p = row.data();
+        const uint8_t *c = &rgb[3 * v * cam.width];
+        for (int u = 0; u < cam.width; ++u, p += 3, c += 3, ++pt)
+        {
+          pt->x = p[0];
+          pt->y = p[1];
+          pt->z = p[2];
+          pt->a = 255;
+          pt->r = c[0];
+          pt->g = c[1];
+          pt->b = c[2];
+        }
+      }
+    });
+
+    float max_error = 0.0f;
+    for (size_t i = 0; i < reference.size(); ++i)
+    {
+      if (std::isnan(reference[i].z) != std::isnan(packed[i].z))
+        max_error = std::numeric_limits<float>::infinity();
+      else if (!std::isnan(reference[i].z))
+        max_error = std::max(max_error, (reference[i].getVector3fMap() - packed[i].getVector3fMap()).norm());
+    }
+
+    std::cout << cam.name << " " << cam.width << "x" << cam.height << ":\n"
+              << "  per pixel:         " << reference_ms << " ms\n"
+              << "  ray table build:   " << table_ms << " ms, once per CameraInfo change\n"
+              << "  ray table:         " << direct_ms << " ms\n"
+              << "  kernel, xyz only:  " << kernel_ms << " ms\n"
+              << "  kernel + packing:  " << packed_ms << " ms, max difference " << max_error * 1000.0f << " mm\n";
+  }
+  return 0;
+}
@@ -0,0 +1,127 @@
+#include <mars_perception/fused_filter.h>
+#include <pcl/common/transforms.h>
+#include <pcl/filters/crop_box.h>
+#include <pcl/filters/voxel_grid.h>
+#include <pcl/io/pcd_io.h>
+#include <pcl_conversions/pcl_conversions.h>
+#include <chrono>
+#include <random>
+#include <iostream>
+
+// Compares the PCL transform + CropBox + VoxelGrid chain against
+// FusedCloudFilter, both from an already converted cloud and from the raw
+// PointCloud2 message. Box and leaf size match global_registration.yml.
+// Without a cloud it runs on a synthetic organized cloud at D455 1280x720
+// density. Timings on the synthetic cloud say little about the robot, run
+// it on a camera frame recorded with pcl_ros pointcloud_to_pcd before
+// switching a registration node to filter_mode "fused".
+//   filter_benchmark [runs] [camera_cloud.pcd]
+
+typedef pcl::PointXYZRGB PointT;
+typedef pcl::PointCloud<PointT> PointCloudT;
+
+static PointCloudT::Ptr make_d455_cloud(int width, int height)
+{
+  PointCloudT::Ptr cloud(new PointCloudT(width, height));
+  std::mt19937 rng(0);
+  std::normal_distribution<float> noise(0.0f, 0.002f);
+  const float fx = 640.0f, fy = 640.0f, cx = width / 2.0f, cy = height / 2.0f;
+  for (int v = 0; v < height; ++v)
+  {
+    for (int u = 0; u < width; ++u)
+    {
+      PointT &p = cloud->at(u, v);
+      // table at ~0.8 m with a few missing returns, like a real depth frame
+      if ((u * 7 + v * 13) % 97 == 0)
+      {
+        p.x = p.y = p.z = std::numeric_limits<float>::quiet_NaN();
+        continue;
+      }
+      float z = 0.8f + 0.1f * std::sin(u * 0.01f) * std::cos(v * 0.01f) + noise(rng);
+      p.x = (u - cx) * z / fx;
+      p.y = (v - cy) * z / fy;
+      p.z = z;
+      p.r = u % 256;
+      p.g = v % 256;
+      p.b = 128;
+    }
+  }
+  cloud->is_dense = false;
+  return cloud;
+}
+
+template <typename F>
+static double time_ms(int iterations, F f)
+{
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < iterations; ++i)
+    f();
+  auto end = std::chrono::steady_clock::now();
+  return std::chrono::duration<double, std::milli>(end - start).count() / iterations;
+}
+
+int main(int argc, char **argv)
+{
+  int iterations = argc > 1 ? std::atoi(argv[1]) : 20;
+
+  PointCloudT::Ptr cloud;
+  if (argc > 2)
+  {
+    // in the camera's optical frame, like the synthetic cloud
+    cloud.reset(new PointCloudT);
+    if (pcl::io::loadPCDFile(argv[2], *cloud) < 0)
+    {
+      std::cerr << "cannot load " << argv[2] << "\n";
+      return 1;
+    }
+  }
+  else
+  {
+    cloud = make_d455_cloud(1280, 720);
+  }
+  Eigen::Affine3f extrinsic = Eigen::Translation3f(0.55f, 0.0f, 0.9f) *
+                              Eigen::AngleAxisf(M_PI, Eigen::Vector3f::UnitX());
+  Eigen::Vector3f box_min(0.2f, -0.4064f, -0.01f), box_max(0.9398f, 0.4064f, 0.20f);
+  Eigen::Vector3f leaf(0.01f, 0.01f, 0.01f);
+
+  PointCloudT pcl_out;
+  double pcl_ms = time_ms(iterations, [&]() {
+    PointCloudT::Ptr tmp(new PointCloudT);
+    pcl::transformPointCloud(*cloud, *tmp, extrinsic);
+
+    pcl::CropBox<PointT> box_filter;
+    box_filter.setInputCloud(tmp);
+    box_filter.setMin(Eigen::Vector4f(box_min[0], box_min[1], box_min[2], 1.0));
+    box_filter.setMax(Eigen::Vector4f(box_max[0], box_max[1], box_max[2], 1.0));
+    box_filter.filter(*tmp);
+
+    pcl::VoxelGrid<PointT> voxel_filter;
+    voxel_filter.setInputCloud(tmp);
+    voxel_filter.setLeafSize(leaf[0], leaf[1], leaf[2]);
+    voxel_filter.filter(pcl_out);
+  });
+
+  FusedCloudFilter fused(box_min, box_max, leaf);
+  PointCloudT fused_out;
+  double fused_ms = time_ms(iterations, [&]() { fused.filter(*cloud, extrinsic, fused_out); });
+
+  sensor_msgs::PointCloud2 msg;
+  pcl::toROSMsg(*cloud, msg);
+  double from_msg_ms = time_ms(iterations, [&]() {
+    PointCloudT tmp;
+    pcl::fromROSMsg(msg, tmp);
+    fused.filter(tmp, extrinsic, fused_out);
+  });
+  double view_ms = time_ms(iterations, [&]() {
+    PointCloud2View view(msg);
+    fused.filter(view, extrinsic, fused_out);
+  });
+
+  std::cout << "input points: " << cloud->size() << "\n";
+  std::cout << "pcl chain:    " << pcl_ms << " ms, " << pcl_out.size() << " points\n";
+  std::cout << "fused:        " << fused_ms << " ms, " << fused_out.size() << " points\n";
+  std::cout << "speedup:      " << pcl_ms / fused_ms << "x\n";
+  std::cout << "fromROSMsg + fused: " << from_msg_ms << " ms\n";
+  std::cout << "view + fused:       " << view_ms << " ms\n";
+  return 0;
+}
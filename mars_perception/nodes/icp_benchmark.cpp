@@ -0,0 +1,124 @@
+#include <mars_perception/icp_pyramid.h>
+#include <mars_perception/mesh_cache.h>
+#include <pcl/common/io.h>
+#include <pcl/common/transforms.h>
+#include <chrono>
+#include <random>
+#include <iostream>
+
+// Aligns a mesh model against a synthetic scene holding the same part at a
+// known pose on a table plane with the single level settings of icp.yml and
+// with its default pyramid, point to point and point to plane, and prints
+// time and pose error.
+//   icp_benchmark <mesh.stl> [runs]
+
+typedef PyramidICP::PointT PointT;
+typedef PyramidICP::PointCloudT PointCloudT;
+
+static PointCloudT::Ptr make_scene(const PointCloudT &model, const Eigen::Matrix4f &pose)
+{
+  PointCloudT::Ptr scene(new PointCloudT);
+  pcl::transformPointCloud(model, *scene, pose);
+
+  std::mt19937 rng(0);
+  std::normal_distribution<float> noise(0.0f, 0.001f);
+  for (auto &p : scene->points)
+  {
+    p.x += noise(rng);
+    p.y += noise(rng);
+    p.z += noise(rng);
+  }
+
+  // 30 x 30 cm table at 1 mm spacing just below the part
+  float table_z = pose(2, 3) - 0.03f;
+  for (int i = -150; i < 150; ++i)
+  {
+    for (int j = -150; j < 150; ++j)
+    {
+      PointT p;
+      p.x = pose(0, 3) + i * 0.001f;
+      p.y = pose(1, 3) + j * 0.001f;
+      p.z = table_z + noise(rng);
+      scene->push_back(p);
+    }
+  }
+  return scene;
+}
+
+static void pose_error(const Eigen::Matrix4f &estimate, const Eigen::Matrix4f &truth, double &trans_mm, double &rot_deg)
+{
+  Eigen::Matrix4f delta = truth.inverse() * estimate;
+  trans_mm = delta.block<3, 1>(0, 3).norm() * 1000.0;
+  rot_deg = Eigen::AngleAxisf(Eigen::Matrix3f(delta.block<3, 3>(0, 0))).angle() * 180.0 / M_PI;
+}
+
+template <typename F>
+static double time_ms(int iterations, F f)
+{
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < iterations; ++i)
+    f();
+  auto end = std::chrono::steady_clock::now();
+  return std::chrono::duration<double, std::milli>(end - start).count() / iterations;
+}
+
+int main(int argc, char **argv)
+{
+  if (argc < 2)
+  {
+    std::cerr << "usage: icp_benchmark <mesh.stl> [runs]\n";
+    return 1;
+  }
+  int iterations = argc > 2 ? std::atoi(argv[2]) : 5;
+
+  pcl::PointCloud<MeshModel::PointNormalT>::Ptr samples(new pcl::PointCloud<MeshModel::PointNormalT>);
+  if (!MeshCache::sample_stl(argv[1], *samples))
+  {
+    std::cerr << "cannot load " << argv[1] << "\n";
+    return 1;
+  }
+  PointCloudT::Ptr model(new PointCloudT);
+  pcl::copyPointCloud(*samples, *model);
+
+  Eigen::Affine3f pose = Eigen::Translation3f(0.03f, -0.02f, 0.01f) *
+                         Eigen::AngleAxisf(0.25f, Eigen::Vector3f(0.2f, 0.3f, 1.0f).normalized());
+  PointCloudT::Ptr scene = make_scene(*model, pose.matrix());
+  std::cout << "model " << model->size() << " points, scene " << scene->size() << " points\n";
+
+  // single level, as ICP::run() with icp.yml
+  std::vector<ICPLevel> single = {{0.0, 0.5, 500, 1e-11}};
+  std::vector<ICPLevel> pyramid = {{0.01, 0.5, 50, 1e-8}, {0.004, 0.05, 30, 1e-8}, {0.0, 0.01, 20, 1e-11}};
+
+  struct Config
+  {
+    const char *name;
+    std::vector<ICPLevel> levels;
+    ICPMethod method;
+  };
+  std::vector<Config> configs = {{"single", single, ICPMethod::POINT_TO_POINT},
+                                 {"pyramid", pyramid, ICPMethod::POINT_TO_POINT},
+                                 {"pyramid point_to_plane", pyramid, ICPMethod::POINT_TO_PLANE}};
+
+  for (const Config &config : configs)
+  {
+    PyramidICP icp(config.levels, config.method);
+    icp.set_fitness_epsilon(0.001);
+    icp.set_source(model, samples);
+    Eigen::Matrix4f tf;
+    double fitness = 0.0;
+    double ms = time_ms(iterations, [&]() {
+      // the scene changes every frame, so its levels count towards the time
+      icp.set_target(scene);
+      tf = icp.align(Eigen::Matrix4f::Identity(), &fitness);
+    });
+
+    double trans_mm, rot_deg;
+    pose_error(tf, pose.matrix(), trans_mm, rot_deg);
+    std::cout << config.name << ": " << ms << " ms, error " << trans_mm << " mm / " << rot_deg
+              << " deg, fitness " << fitness << ", levels (ms):";
+    for (double level_ms : icp.level_times())
+      std::cout << " " << level_ms;
+    std::cout << "\n";
+  }
+  return 0;
+}
@@ -2,12 +2,7 @@
 
 int main(int argc, char** argv) {
     ros::init(argc, argv, "icp_server");
-    ros::NodeHandle n;
-    ros::Rate r(50);
-    ICP icp;
-    while(ros::ok()) {
-        ros::spinOnce();
-        icp.run();
-        r.sleep();
-    }
+    ros::NodeHandle nh, pnh("~");
+    ICP icp(nh, pnh);
+    ros::spin();
 }
\ No newline at end of file
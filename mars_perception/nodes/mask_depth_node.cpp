@@ -2,7 +2,8 @@
 
 int main(int argc, char **argv)
 {
-    ros::init(argc, argv, "pc_registration");
-    MaskDepth depth_mask;
+    ros::init(argc, argv, "mask_depth");
+    ros::NodeHandle nh, pnh("~");
+    MaskDepth depth_mask(nh, pnh);
     ros::spin();
 }
\ No newline at end of file
@@ -0,0 +1,90 @@
+#include <mars_perception/mesh_sampling.h>
+#include <mars_perception/stl_reader.h>
+#include <pcl/io/vtk_lib_io.h>
+#include <ros/ros.h>
+#include <chrono>
+#include <iostream>
+
+// Times loading and sampling every mesh under ~meshes (mesh.yml, see
+// mesh_load_benchmark.launch) through PCL's STL loader + VTK and through
+// read_stl, mapped and read, and the mesh's evenly spaced sampling if it
+// sets points.
+//   roslaunch mars_perception mesh_load_benchmark.launch [runs:=5]
+
+typedef pcl::PointCloud<pcl::PointXYZRGBNormal> PointCloudNT;
+
+template <typename F>
+static double time_ms(int iterations, F f)
+{
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < iterations; ++i)
+    f();
+  auto end = std::chrono::steady_clock::now();
+  return std::chrono::duration<double, std::milli>(end - start).count() / iterations;
+}
+
+int main(int argc, char **argv)
+{
+  ros::init(argc, argv, "mesh_load_benchmark");
+  ros::NodeHandle pnh("~");
+  int iterations = 5;
+  pnh.getParam("runs", iterations);
+
+  XmlRpc::XmlRpcValue meshes;
+  if (!pnh.getParam("meshes", meshes) || meshes.getType() != XmlRpc::XmlRpcValue::TypeStruct)
+  {
+    std::cerr << "~meshes must map mesh names to STL paths\n";
+    return 1;
+  }
+
+  for (auto it = meshes.begin(); it != meshes.end(); ++it)
+  {
+    XmlRpc::XmlRpcValue &entry = it->second;
+    int points = 0;
+    std::string path;
+    if (entry.getType() == XmlRpc::XmlRpcValue::TypeString)
+    {
+      path = static_cast<std::string>(entry);
+    }
+    else if (entry.getType() == XmlRpc::XmlRpcValue::TypeStruct && entry.hasMember("path"))
+    {
+      path = static_cast<std::string>(entry["path"]);
+      if (entry.hasMember("points") && entry["points"].getType() == XmlRpc::XmlRpcValue::TypeInt)
+        points = static_cast<int>(entry["points"]);
+    }
+    TriangleList triangles;
+    if (!read_stl(path, triangles))
+      continue;
+
+    // loading only, then loading and sampling into the model cloud
+    pcl::PolygonMesh mesh;
+    double pcl_load = time_ms(iterations, [&]() { pcl::io::loadPolygonFileSTL(path, mesh); });
+    double mmap_load = time_ms(iterations, [&]() { read_stl(path, triangles, true); });
+    double read_load = time_ms(iterations, [&]() { read_stl(path, triangles, false); });
+
+    PointCloudNT::Ptr cloud(new PointCloudNT);
+    double pcl_total = time_ms(iterations, [&]() {
+      pcl::PolygonMesh m;
+      pcl::io::loadPolygonFileSTL(path, m);
+      polygon_mesh_to_pc(&m, cloud);
+    });
+    size_t pcl_points = cloud->size();
+    double stl_total = time_ms(iterations, [&]() {
+      TriangleList t;
+      read_stl(path, t);
+      triangles_to_pc(t, *cloud);
+    });
+
+    std::cout << it->first << ": " << triangles.size() << " triangles\n"
+              << "  load:            pcl " << pcl_load << " ms, read_stl mmap " << mmap_load << " ms, read "
+              << read_load << " ms\n"
+              << "  load + sampling: pcl/vtk " << pcl_total << " ms (" << pcl_points << " points), read_stl "
+              << stl_total << " ms (" << cloud->size() << " points)\n";
+    if (points > 0)
+    {
+      double poisson = time_ms(iterations, [&]() { poisson_disk_to_pc(triangles, *cloud, 0.0, points); });
+      std::cout << "  poisson disk:    " << poisson << " ms (" << cloud->size() << " points)\n";
+    }
+  }
+  return 0;
+}
@@ -3,6 +3,7 @@
 int main(int argc, char **argv)
 {
     ros::init(argc, argv, "pc_registration");
-    PCRegistration preprocess;
+    ros::NodeHandle nh, pnh("~");
+    PCRegistration preprocess(nh, pnh);
     ros::spin();
 }
\ No newline at end of file
@@ -0,0 +1,47 @@
+#include <mars_perception/cloud_view.h>
+
+PointCloud2View::PointCloud2View(const sensor_msgs::PointCloud2 &msg)
+    : data_(msg.data.data()), width_(msg.width), height_(msg.height),
+      point_step_(msg.point_step), row_step_(msg.row_step)
+{
+  x_offset_ = field_offset_(msg, "x", sensor_msgs::PointField::FLOAT32);
+  y_offset_ = field_offset_(msg, "y", sensor_msgs::PointField::FLOAT32);
+  z_offset_ = field_offset_(msg, "z", sensor_msgs::PointField::FLOAT32);
+
+  // realsense packs color as a FLOAT32 "rgb", depth_image_proc may emit "rgba"
+  rgb_offset_ = field_offset_(msg, "rgb", sensor_msgs::PointField::FLOAT32);
+  if (rgb_offset_ < 0)
+    rgb_offset_ = field_offset_(msg, "rgba", sensor_msgs::PointField::UINT32);
+
+  is_dense_ = msg.is_dense;
+  contiguous_ = row_step_ == width_ * point_step_;
+  valid_ = x_offset_ >= 0 && y_offset_ >= 0 && z_offset_ >= 0 && !msg.is_bigendian &&
+           msg.data.size() >= size_t(row_step_) * height_;
+}
+
+int PointCloud2View::field_offset_(const sensor_msgs::PointCloud2 &msg, const std::string &name, uint8_t datatype)
+{
+  for (const auto &field : msg.fields)
+  {
+    if (field.name == name && field.datatype == datatype && field.count >= 1)
+      return field.offset;
+  }
+  return -1;
+}
+
+void PointCloud2View::copy_to(pcl::PointCloud<pcl::PointXYZRGB> &cloud) const
+{
+  cloud.resize(size());
+  cloud.width = width_;
+  cloud.height = height_;
+  cloud.is_dense = is_dense_;
+
+  Eigen::Vector4f p;
+  uint32_t rgba;
+  for (size_t i = 0; i < size(); ++i)
+  {
+    read(i, p, rgba);
+    cloud.points[i].getVector4fMap() = p;
+    cloud.points[i].rgba = rgba;
+  }
+}
@@ -0,0 +1,80 @@
+#include <mars_perception/extrinsics_cache.h>
+
+ExtrinsicsCache::ExtrinsicsCache(ros::NodeHandle &nh, tf::TransformListener &listener, const std::string &target_frame, double timeout)
+    : listener_(listener), target_frame_(target_frame), timeout_(std::max(timeout, 0.0))
+{
+  tf_static_sub_ = nh.subscribe("/tf_static", 10, &ExtrinsicsCache::tf_static_cb_, this);
+}
+
+Eigen::Affine3f ExtrinsicsCache::lookup(const std::string &source_frame)
+{
+  ros::WallTime now = ros::WallTime::now();
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = entries_.find(source_frame);
+    if (it != entries_.end() && (timeout_.isZero() || now - it->second.stamp < timeout_))
+    {
+      return it->second.tf;
+    }
+  }
+
+  // resolve outside the lock so a slow lookup does not stall other cameras
+  tf::StampedTransform transform;
+  listener_.waitForTransform(target_frame_, source_frame, ros::Time(0), ros::Duration(1.0));
+  listener_.lookupTransform(target_frame_, source_frame, ros::Time(0), transform);
+
+  Eigen::Matrix4f mat;
+  pcl_ros::transformAsMatrix(transform, mat);
+
+  Entry entry;
+  entry.tf = Eigen::Affine3f(mat);
+  entry.stamp = now;
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (is_static_(source_frame))
+    entries_[source_frame] = entry;
+  return entry.tf;
+}
+
+bool ExtrinsicsCache::is_static_(const std::string &source_frame) const
+{
+  // both chains climb towards the root, they meet at a common ancestor if
+  // every link in between is static. The step bound guards against cycles.
+  std::set<std::string> target_chain;
+  std::string frame = tf::strip_leading_slash(target_frame_);
+  for (size_t i = 0; i <= static_parents_.size(); ++i)
+  {
+    target_chain.insert(frame);
+    auto parent = static_parents_.find(frame);
+    if (parent == static_parents_.end())
+      break;
+    frame = parent->second;
+  }
+  frame = tf::strip_leading_slash(source_frame);
+  for (size_t i = 0; i <= static_parents_.size(); ++i)
+  {
+    if (target_chain.count(frame))
+      return true;
+    auto parent = static_parents_.find(frame);
+    if (parent == static_parents_.end())
+      return false;
+    frame = parent->second;
+  }
+  return false;
+}
+
+void ExtrinsicsCache::invalidate()
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  entries_.clear();
+}
+
+void ExtrinsicsCache::tf_static_cb_(const tf2_msgs::TFMessage::ConstPtr &msg)
+{
+  ROS_DEBUG("/tf_static changed, dropping cached extrinsics");
+  std::lock_guard<std::mutex> lock(mutex_);
+  // each static publisher latches its own message, so links accumulate
+  for (const auto &t : msg->transforms)
+    static_parents_[tf::strip_leading_slash(t.child_frame_id)] = tf::strip_leading_slash(t.header.frame_id);
+  entries_.clear();
+}
@@ -0,0 +1,146 @@
+#include <mars_perception/feature_alignment.h>
+#include <pcl/common/io.h>
+#include <pcl/filters/voxel_grid.h>
+#include <pcl/filters/filter.h>
+
+FeatureAligner::FeatureAligner(const Params &params) : params_(params)
+{
+}
+
+FeatureAligner::Params FeatureAligner::load_params(ros::NodeHandle &nh)
+{
+  Params p;
+  p.leaf_size = 0.004;
+  p.normal_radius = 0.008;
+  p.feature_radius = 0.02;
+  p.max_iterations = 20000;
+  p.samples = 3;
+  p.correspondence_randomness = 5;
+  p.similarity_threshold = 0.9;
+  p.max_correspondence_distance = 0.006;
+  p.inlier_fraction = 0.25;
+  p.threads = 0;
+
+  nh.getParam("leaf_size", p.leaf_size);
+  nh.getParam("normal_radius", p.normal_radius);
+  nh.getParam("feature_radius", p.feature_radius);
+  nh.getParam("max_iterations", p.max_iterations);
+  nh.getParam("samples", p.samples);
+  nh.getParam("correspondence_randomness", p.correspondence_randomness);
+  nh.getParam("similarity_threshold", p.similarity_threshold);
+  nh.getParam("max_correspondence_distance", p.max_correspondence_distance);
+  nh.getParam("inlier_fraction", p.inlier_fraction);
+  nh.getParam("threads", p.threads);
+  return p;
+}
+
+void FeatureAligner::compute_features_(Features &f, int threads) const
+{
+  // threads 0 lets OpenMP use every core
+  pcl::FPFHEstimationOMP<PointNT, PointNT, FeatureT> fpfh(std::max(threads, 0));
+  fpfh.setInputCloud(f.points);
+  fpfh.setInputNormals(f.points);
+  fpfh.setRadiusSearch(params_.feature_radius);
+  f.features.reset(new FeatureCloudT);
+  fpfh.compute(*f.features);
+}
+
+void FeatureAligner::prepare_model(const MeshModelConstPtr &model)
+{
+  // the loader pool already runs one mesh per core, a full OpenMP team
+  // per loader thread would oversubscribe the machine
+  model_features_(model, 1);
+}
+
+std::shared_ptr<const FeatureAligner::Features> FeatureAligner::model_features_(const MeshModelConstPtr &model,
+                                                                                int threads)
+{
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = models_.find(model->name);
+    if (it != models_.end() && it->second.model.lock() == model)
+      return it->second.features;
+  }
+
+  // the model already carries surface normals from the mesh, only the
+  // descriptors have to be computed
+  std::shared_ptr<Features> f(new Features);
+  pcl::PointCloud<MeshModel::PointNormalT> voxels;
+  pcl::VoxelGrid<MeshModel::PointNormalT> voxel_filter;
+  voxel_filter.setInputCloud(model->cloud_normals);
+  voxel_filter.setLeafSize(params_.leaf_size, params_.leaf_size, params_.leaf_size);
+  voxel_filter.filter(voxels);
+  f->points.reset(new PointCloudNT);
+  pcl::copyPointCloud(voxels, *f->points);
+  for (auto &p : f->points->points)
+    p.getNormalVector3fMap().normalize();
+  compute_features_(*f, threads);
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  ModelEntry &entry = models_[model->name];
+  entry.model = model;
+  entry.features = f;
+  return f;
+}
+
+void FeatureAligner::set_scene(const PointCloudT::ConstPtr &scene)
+{
+  std::shared_ptr<Features> f(new Features);
+  PointCloudT::Ptr voxels(new PointCloudT);
+  pcl::VoxelGrid<PointT> voxel_filter;
+  voxel_filter.setInputCloud(scene);
+  voxel_filter.setLeafSize(params_.leaf_size, params_.leaf_size, params_.leaf_size);
+  voxel_filter.filter(*voxels);
+
+  pcl::NormalEstimationOMP<PointT, PointNT> normals(std::max(params_.threads, 0));
+  normals.setInputCloud(voxels);
+  normals.setRadiusSearch(params_.normal_radius);
+  f->points.reset(new PointCloudNT);
+  normals.compute(*f->points);
+  // the normal estimator only fills the normal fields, and leaves them NaN
+  // where a point has too few neighbours
+  for (size_t i = 0; i < voxels->size(); ++i)
+    f->points->points[i].getVector3fMap() = voxels->points[i].getVector3fMap();
+  std::vector<int> valid;
+  pcl::removeNaNNormalsFromPointCloud(*f->points, *f->points, valid);
+  compute_features_(*f, params_.threads);
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  scene_ = f;
+}
+
+bool FeatureAligner::align(const MeshModelConstPtr &model, Eigen::Matrix4f &tf, double *inlier_fraction)
+{
+  std::shared_ptr<const Features> scene;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    scene = scene_;
+  }
+  if (!scene || scene->points->empty())
+    return false;
+  std::shared_ptr<const Features> source = model_features_(model, params_.threads);
+  if (source->points->empty())
+    return false;
+
+  pcl::SampleConsensusPrerejective<PointNT, PointNT, FeatureT> ransac;
+  ransac.setInputSource(source->points);
+  ransac.setSourceFeatures(source->features);
+  ransac.setInputTarget(scene->points);
+  ransac.setTargetFeatures(scene->features);
+  ransac.setMaximumIterations(params_.max_iterations);
+  ransac.setNumberOfSamples(params_.samples);
+  ransac.setCorrespondenceRandomness(params_.correspondence_randomness);
+  ransac.setSimilarityThreshold(params_.similarity_threshold);
+  ransac.setMaxCorrespondenceDistance(params_.max_correspondence_distance);
+  ransac.setInlierFraction(params_.inlier_fraction);
+
+  PointCloudNT aligned;
+  ransac.align(aligned);
+  if (!ransac.hasConverged())
+    return false;
+
+  tf = ransac.getFinalTransformation();
+  if (inlier_fraction)
+    *inlier_fraction = double(ransac.getInliers().size()) / source->points->size();
+  return true;
+}
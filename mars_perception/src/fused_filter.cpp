@@ -0,0 +1,59 @@
+#include <mars_perception/fused_filter.h>
+
+constexpr uint64_t FusedCloudFilter::MAX_DENSE_CELLS;
+constexpr uint32_t FusedCloudFilter::EMPTY_SLOT;
+
+FusedCloudFilter::FusedCloudFilter()
+    : FusedCloudFilter(Eigen::Vector3f::Constant(-1.0f), Eigen::Vector3f::Constant(1.0f), Eigen::Vector3f::Constant(0.01f))
+{
+}
+
+FusedCloudFilter::FusedCloudFilter(const Eigen::Vector3f &box_min, const Eigen::Vector3f &box_max, const Eigen::Vector3f &leaf_size)
+{
+  box_min_ << box_min, 1.0f;
+  box_max_ << box_max, 1.0f;
+  inv_leaf_ << leaf_size.cwiseInverse(), 0.0f;
+  update_grid_();
+}
+
+void FusedCloudFilter::set_box(const Eigen::Vector3f &box_min, const Eigen::Vector3f &box_max)
+{
+  // w is 1 for every transformed point, same as pcl::CropBox
+  box_min_ << box_min, 1.0f;
+  box_max_ << box_max, 1.0f;
+  update_grid_();
+}
+
+void FusedCloudFilter::set_leaf_size(const Eigen::Vector3f &leaf_size)
+{
+  inv_leaf_ << leaf_size.cwiseInverse(), 0.0f;
+  update_grid_();
+}
+
+void FusedCloudFilter::update_grid_()
+{
+  const Eigen::Array4i grid_max = (box_max_.array() * inv_leaf_.array()).floor().cast<int>();
+  grid_min_ = (box_min_.array() * inv_leaf_.array()).floor().cast<int>();
+  grid_dx_ = grid_max[0] - grid_min_[0] + 1;
+  grid_dxy_ = grid_dx_ * (grid_max[1] - grid_min_[1] + 1);
+
+  const uint64_t cells = grid_dxy_ * (grid_max[2] - grid_min_[2] + 1);
+  dense_slots_.clear();
+  if (cells <= MAX_DENSE_CELLS)
+    dense_slots_.assign(cells, EMPTY_SLOT);
+}
+
+void FusedCloudFilter::filter(const PointCloudT &in, const Eigen::Affine3f &extrinsic, PointCloudT &out)
+{
+  filter(in.size(), [&in](size_t i, Eigen::Vector4f &p, uint32_t &rgba) {
+    p = in.points[i].getVector4fMap();
+    p[3] = 1.0f;
+    rgba = in.points[i].rgba;
+  }, extrinsic, out);
+  out.header = in.header;
+}
+
+void FusedCloudFilter::filter(const PointCloud2View &in, const Eigen::Affine3f &extrinsic, PointCloudT &out)
+{
+  filter(in.size(), [&in](size_t i, Eigen::Vector4f &p, uint32_t &rgba) { in.read(i, p, rgba); }, extrinsic, out);
+}
@@ -1,108 +1,607 @@
 #include <mars_perception/icp.h>
 
 
-ICP::ICP() : mesh_pc_(new PointCloud), scene_pc_(new PointCloud), tf_(TFMatrix::Identity())
+ICP::ICP(ros::NodeHandle &nh, ros::NodeHandle &pnh)
+    : labelled_leaf_size_(0.0), scene_source_{-1, 0}, empty_selection_{-1, 0}, mesh_pc_(new PointCloud), scene_pc_(new PointCloud), scene_generation_(0), hash_cell_(0.0), correspondence_threads_(1), scene_search_generation_(0), feature_generation_(0), tracked_generation_(0), tracking_ms_(0.0), nh_(nh), pnh_(pnh), tf_(TFMatrix::Identity()), fitness_(0.0)
 {
-    ros::param::get("~max_correspondence_distance", max_corresp_dist_);
-    ros::param::get("~transformation_epsilon", transf_epsilon_);
-    ros::param::get("~fitness_epsilon", fitness_epsilon_);
-    ros::param::get("~max_iterations", max_iter_);
+    max_corresp_dist_ = 0.5;
+    transf_epsilon_ = 1e-11;
+    fitness_epsilon_ = 0.001;
+    max_iter_ = 500;
+    pnh_.getParam("max_correspondence_distance", max_corresp_dist_);
+    pnh_.getParam("transformation_epsilon", transf_epsilon_);
+    pnh_.getParam("fitness_epsilon", fitness_epsilon_);
+    pnh_.getParam("max_iterations", max_iter_);
     ros::param::get("/base_frame", base_frame_);
 
+    std::string method = "point_to_point";
+    pnh_.getParam("method", method);
+    if (!parse_icp_method(method, default_method_))
+    {
+        ROS_WARN("Unknown ICP method %s, using point_to_point", method.c_str());
+        default_method_ = ICPMethod::POINT_TO_POINT;
+    }
+    method_ = default_method_;
+    double normal_radius = 0.005;
+    pnh_.getParam("normal_radius", normal_radius);
+    pnh_.getParam("icp_voxel_hash_cell", hash_cell_);
+    pnh_.getParam("correspondence_threads", correspondence_threads_);
+
+    std::vector<ICPLevel> levels;
+    if (PyramidICP::load_levels(pnh_, "pyramid", levels))
+    {
+        pyramid_.icp.set_levels(levels);
+        pyramid_.icp.set_fitness_epsilon(fitness_epsilon_);
+        pyramid_.icp.set_normal_radius(normal_radius);
+        pyramid_.icp.set_hash_cell(hash_cell_);
+        pyramid_.icp.set_correspondence_threads(correspondence_threads_);
+    }
+
+    bool feature_alignment = false;
+    pnh_.getParam("feature_alignment/enabled", feature_alignment);
+    if (feature_alignment)
+    {
+        ros::NodeHandle feature_nh(pnh_, "feature_alignment");
+        feature_aligner_.reset(new FeatureAligner(FeatureAligner::load_params(feature_nh)));
+        if (PyramidICP::load_levels(feature_nh, "refine_levels", levels))
+        {
+            refine_.icp.set_levels(levels);
+            refine_.icp.set_fitness_epsilon(fitness_epsilon_);
+            refine_.icp.set_normal_radius(normal_radius);
+            refine_.icp.set_hash_cell(hash_cell_);
+            refine_.icp.set_correspondence_threads(correspondence_threads_);
+        }
+    }
+
+    ICPLevel tracking_level{0.002, 0.01, 10, 1e-6};
+    tracking_enabled_ = true;
+    tracking_margin_ = 0.02;
+    tracking_min_points_ = 50;
+    pnh_.getParam("tracking/enabled", tracking_enabled_);
+    pnh_.getParam("tracking/roi_margin", tracking_margin_);
+    pnh_.getParam("tracking/min_points", tracking_min_points_);
+    pnh_.getParam("tracking/leaf_size", tracking_level.leaf_size);
+    pnh_.getParam("tracking/max_correspondence_distance", tracking_level.max_correspondence_distance);
+    pnh_.getParam("tracking/max_iterations", tracking_level.max_iterations);
+    pnh_.getParam("tracking/transformation_epsilon", tracking_level.transformation_epsilon);
+    // the scene changes every tick, target normals would cost more than
+    // the few extra point to point iterations from a warm start
+    tracking_.icp = PyramidICP({tracking_level}, ICPMethod::POINT_TO_POINT);
+    tracking_.icp.set_fitness_epsilon(fitness_epsilon_);
+    tracking_.icp.set_hash_cell(hash_cell_);
+
+    // yaw_steps rotations about z, doubled by flipping the part over
+    int yaw_steps = 1;
+    bool flip = false;
+    hypothesis_last_pose_ = true;
+    hypothesis_keep_ratio_ = 0.8;
+    pnh_.getParam("hypotheses/yaw_steps", yaw_steps);
+    pnh_.getParam("hypotheses/flip", flip);
+    pnh_.getParam("hypotheses/last_pose", hypothesis_last_pose_);
+    pnh_.getParam("hypotheses/keep_ratio", hypothesis_keep_ratio_);
+    for (int f = 0; f < (flip ? 2 : 1); ++f)
+    {
+        for (int i = 0; i < std::max(yaw_steps, 1); ++i)
+        {
+            Eigen::Affine3f rotation(Eigen::AngleAxisf(2.0 * M_PI * i / std::max(yaw_steps, 1), Eigen::Vector3f::UnitZ()) *
+                                     Eigen::AngleAxisf(M_PI * f, Eigen::Vector3f::UnitX()));
+            hypothesis_rotations_.push_back(rotation.matrix());
+        }
+    }
+    // shared by the hypotheses of single calls and the objects of batch calls
+    int worker_threads = 0;
+    pnh_.getParam("icp_worker_threads", worker_threads);
+    if (worker_threads <= 0)
+        worker_threads = std::thread::hardware_concurrency();
+    if (worker_threads > 1)
+        worker_pool_.reset(new boost::asio::thread_pool(worker_threads));
+
     std::string scene_pc_topic;
-    ros::param::get("~filtered_points_topic", scene_pc_topic);
+    pnh_.getParam("filtered_points_topic", scene_pc_topic);
+    pnh_.getParam("labelled_points_topic", labelled_topic_);
+    pnh_.getParam("labelled_leaf_size", labelled_leaf_size_);
+    ros::param::get("/detect_class_names", class_names_);
+
+    // meshes listed under ~meshes are sampled in the background at startup.
+    // Without that list paths are looked up by name like before and each
+    // model is cached on first use
+    std::string mesh_cache_dir;
+    const char *ros_home = getenv("ROS_HOME");
+    const char *home = getenv("HOME");
+    if (ros_home)
+        mesh_cache_dir = std::string(ros_home) + "/mesh_cache";
+    else if (home)
+        mesh_cache_dir = std::string(home) + "/.ros/mesh_cache";
+    int mesh_loader_threads = 0;
+    pnh_.getParam("mesh_cache_dir", mesh_cache_dir);
+    pnh_.getParam("mesh_loader_threads", mesh_loader_threads);
+
+    XmlRpc::XmlRpcValue meshes;
+    if (pnh_.getParam("meshes", meshes) && meshes.getType() == XmlRpc::XmlRpcValue::TypeStruct)
+    {
+        ros::NodeHandle mesh_nh(pnh_, "meshes");
+        mesh_cache_.reset(new MeshCache(mesh_nh, mesh_cache_dir, mesh_loader_threads));
+        std::vector<std::string> names;
+        for (auto it = meshes.begin(); it != meshes.end(); ++it)
+            names.push_back(it->first);
+        // model descriptors are computed right after each mesh is sampled
+        MeshCache::LoadedCallback on_loaded;
+        if (feature_aligner_)
+            on_loaded = [this](const MeshModelConstPtr &model) { feature_aligner_->prepare_model(model); };
+        mesh_cache_->preload(names, on_loaded);
+    }
+    else
+    {
+        mesh_cache_.reset(new MeshCache(nh_, mesh_cache_dir, mesh_loader_threads));
+    }
 
     icp_mesh_srv_ = nh_.advertiseService("icp_mesh_tf", &ICP::mesh_icp_srv, this);
+    icp_batch_srv_ = nh_.advertiseService("icp_mesh_tf_batch", &ICP::mesh_icp_batch_srv, this);
+    ros::NodeHandle action_nh(nh_);
+    action_nh.setCallbackQueue(&action_queue_);
+    register_action_.reset(new RegisterMeshServer(action_nh, "register_mesh",
+                                                  boost::bind(&ICP::register_mesh_cb_, this, _1), false));
+    register_action_->start();
+    action_spinner_.reset(new ros::AsyncSpinner(1, &action_queue_));
+    action_spinner_->start();
     mesh_pub_ = nh_.advertise<sensor_msgs::PointCloud2>("object_mesh_pc", 10);
-    scene_pc_sub_ = nh_.subscribe(scene_pc_topic, 10, &ICP::scene_pc_cb_, this);
+    // only the newest scene is ever used
+    scene_pc_sub_ = nh_.subscribe(scene_pc_topic, 1, &ICP::scene_pc_cb_, this);
+    if (!labelled_topic_.empty())
+        labelled_pc_sub_ = nh_.subscribe(labelled_topic_, 1, &ICP::labelled_pc_cb_, this);
+
+    double run_rate = 50.0;
+    pnh_.getParam("run_rate", run_rate);
+    run_timer_ = nh_.createTimer(ros::Duration(1.0 / run_rate), boost::bind(&ICP::run, this));
 }
 
 void ICP::scene_pc_cb_(const PointCloudMsg::ConstPtr &msg)
 {
-    pcl::fromROSMsg(*msg, *scene_pc_);
+    scene_msg_.store(msg);
+}
+
+void ICP::labelled_pc_cb_(const PointCloudMsg::ConstPtr &msg)
+{
+    labelled_msg_.store(msg);
 }
 
-void ICP::set_mesh_(std::string mesh_name)
+void ICP::set_scene_(const PointCloudPtr &scene, const SceneSource &source)
 {
-    if(ros::param::has(mesh_name)) {
-        std::string mesh_path;
-        nh_.getParam(mesh_name, mesh_path);
-        std::cout << "Mesh: " << mesh_path << "\n";
-        pcl::PolygonMesh mesh;
-        pcl::io::loadPolygonFileSTL(mesh_path, mesh);
-        polygon_mesh_to_pc(&mesh, mesh_pc_);
+    scene_pc_ = scene;
+    scene_source_ = source;
+    ++scene_generation_;
+}
+
+ICP::PointCloudPtr ICP::select_class_(const PointCloudMsg &msg, int class_index) const
+{
+    auto field = std::find_if(msg.fields.begin(), msg.fields.end(),
+                              [](const sensor_msgs::PointField &f) { return f.name == "label"; });
+    if (field == msg.fields.end())
+    {
+        ROS_WARN_ONCE("%s has no label field, is it MaskDepth's masked points topic?", labelled_topic_.c_str());
+        return PointCloudPtr(new PointCloud);
+    }
+
+    pcl::PointCloud<pcl::PointXYZRGBL> labelled;
+    pcl::fromROSMsg(msg, labelled);
+    std::vector<int> indices;
+    for (size_t i = 0; i < labelled.size(); ++i)
+    {
+        if (label_class_index(labelled.points[i].label) == class_index)
+            indices.push_back(static_cast<int>(i));
+    }
 
-        for (int i = 0; i < mesh_pc_->points.size(); i++)
+    PointCloudPtr scene(new PointCloud);
+    pcl::copyPointCloud(labelled, indices, *scene);
+    // MaskDepth's points are not voxelized like the filtered scene
+    if (labelled_leaf_size_ > 0.0 && !scene->empty())
+    {
+        PointCloudPtr voxelized(new PointCloud);
+        pcl::VoxelGrid<Point> voxel_filter;
+        voxel_filter.setInputCloud(scene);
+        voxel_filter.setLeafSize(labelled_leaf_size_, labelled_leaf_size_, labelled_leaf_size_);
+        voxel_filter.filter(*voxelized);
+        scene = voxelized;
+    }
+    scene->header = labelled.header;
+    return scene;
+}
+
+void ICP::update_scene_(const std::string &mesh_name)
+{
+    uint64_t generation;
+    auto name = std::find(class_names_.begin(), class_names_.end(), mesh_name);
+    if (!labelled_topic_.empty() && name != class_names_.end())
+    {
+        PointCloudMsg::ConstPtr msg = labelled_msg_.load(generation);
+        SceneSource source{static_cast<int>(name - class_names_.begin()), generation};
+        if (msg && source == scene_source_)
+            return;
+        if (msg && !(source == empty_selection_))
         {
-            mesh_pc_->points[i].x /= 1000;
-            mesh_pc_->points[i].y /= 1000;
-            mesh_pc_->points[i].z /= 1000;
+            PointCloudPtr scene = select_class_(*msg, source.class_index);
+            if (!scene->empty())
+            {
+                set_scene_(scene, source);
+                return;
+            }
+            empty_selection_ = source;
         }
+        ROS_WARN_THROTTLE(5.0, "No labelled %s points, registering against the whole scene", mesh_name.c_str());
+    }
+
+    PointCloudMsg::ConstPtr msg = scene_msg_.load(generation);
+    if (!msg || scene_source_ == SceneSource{-1, generation})
+        return;
+
+    // ICP needs an owned target cloud, but one pass from the view skips
+    // the buffer copy fromROSMsg makes before repacking. Each scene gets a
+    // fresh cloud since the search trees keep pointing at the old one.
+    PointCloudPtr scene(new PointCloud);
+    PointCloud2View view(*msg);
+    if (view.valid())
+    {
+        view.copy_to(*scene);
+        scene->header = pcl_conversions::toPCL(msg->header);
+    }
+    else
+    {
+        pcl::fromROSMsg(*msg, *scene);
+    }
+    set_scene_(scene, SceneSource{-1, generation});
+}
+
+void ICP::prepare_scene_search_()
+{
+    if (scene_search_generation_ == scene_generation_ && (scene_tree_ || scene_hash_))
+        return;
+    scene_tree_.reset();
+    scene_hash_.reset();
+    if (hash_cell_ > 0.0 && VoxelHash::suits(hash_cell_, max_corresp_dist_))
+    {
+        scene_hash_ = std::make_shared<VoxelHash>(*scene_pc_, hash_cell_);
+    }
+    else
+    {
+        scene_tree_.reset(new SearchTree);
+        scene_tree_->setInputCloud(scene_pc_);
+    }
+    scene_search_generation_ = scene_generation_;
+}
+
+void ICP::set_scene_search_(pcl::IterativeClosestPoint<Point, Point> &icp) const
+{
+    if (scene_hash_)
+    {
+        icp.setCorrespondenceEstimation(pcl::IterativeClosestPoint<Point, Point>::CorrespondenceEstimationPtr(
+            new VoxelHashCorrespondence<Point, Point>(scene_hash_, correspondence_threads_)));
+        icp.setSearchMethodTarget(SearchTree::Ptr(new SearchTree), true);
+    }
+    else
+    {
+        icp.setSearchMethodTarget(scene_tree_, true);
+    }
+}
+
+ICPScore ICP::score_scene_(const PointCloud &aligned) const
+{
+    // getFitnessScore would search the empty tree handed to ICP in hash mode
+    return score_alignment(aligned, scene_hash_.get(), scene_tree_.get(), max_corresp_dist_);
+}
+
+void ICP::set_mesh_(const std::string &mesh_name, const MeshModelConstPtr &model)
+{
+    // the cached model is shared, ICP aligns a private copy in place
+    model_ = model;
+    pcl::copyPointCloud(*model_->cloud, *mesh_pc_);
+    mesh_name_ = mesh_name;
+    tf_ = TFMatrix::Identity();
+    fitness_ = 0.0;
+}
+
+void ICP::prepare_target_(PyramidStage &stage)
+{
+    stage.icp.set_method(method_);
+    if (stage.generation != scene_generation_)
+    {
+        prepare_scene_search_();
+        stage.icp.set_target(scene_pc_, scene_tree_);
+        stage.generation = scene_generation_;
+    }
+}
+
+void ICP::prepare_stage_(PyramidStage &stage)
+{
+    prepare_target_(stage);
+    if (stage.model != model_)
+    {
+        stage.icp.set_source(model_->cloud, model_->cloud_normals);
+        stage.model = model_;
+    }
+}
+
+void ICP::prepare_scene_()
+{
+    prepare_scene_search_();
+    if (!pyramid_.icp.empty())
+        prepare_target_(pyramid_);
+    if (!refine_.icp.empty())
+        prepare_target_(refine_);
+    if (feature_aligner_ && feature_generation_ != scene_generation_)
+    {
+        feature_aligner_->set_scene(scene_pc_);
+        feature_generation_ = scene_generation_;
+    }
+}
+
+ICP::TFMatrix ICP::align_stage_(PyramidStage &stage, const TFMatrix &guess)
+{
+    prepare_stage_(stage);
+    return stage.icp.align(guess, &fitness_);
+}
 
-        float centroid_x = 0.0;
-        float centroid_y = 0.0;
-        float centroid_z = 0.0;
+void ICP::parallel_for_(size_t n, const std::function<void(size_t)> &body)
+{
+    if (!worker_pool_)
+    {
+        for (size_t i = 0; i < n; ++i)
+            body(i);
+        return;
+    }
+
+    std::vector<std::future<void>> pending;
+    for (size_t i = 0; i < n; ++i)
+    {
+        auto task = std::make_shared<std::packaged_task<void()>>(std::bind(body, i));
+        pending.push_back(task->get_future());
+        boost::asio::post(*worker_pool_, [task]() { (*task)(); });
+    }
+    for (auto &p : pending)
+        p.wait();
+    for (auto &p : pending)
+        p.get();
+}
 
-        for (int i = 0; i < mesh_pc_->points.size(); i++)
+void ICP::align_hypotheses_(const PyramidICP &icp, const std::string &name, bool parallel, const Progress &progress,
+                            ObjectPose &pose)
+{
+    struct Hypothesis
+    {
+        TFMatrix tf;
+        ICPScore score;
+    };
+
+    // the model is centered, so rotating on the right turns it in place
+    std::vector<Hypothesis> alive;
+    for (const TFMatrix &rotation : hypothesis_rotations_)
+        alive.push_back({pose.tf * rotation, ICPScore()});
+    auto last = last_poses_.find(name);
+    if (hypothesis_last_pose_ && last != last_poses_.end())
+        alive.push_back({last->second, ICPScore()});
+
+    size_t started = alive.size();
+
+    for (size_t level = 0; level < icp.level_count(); ++level)
+    {
+        auto body = [&](size_t i) { alive[i].tf = icp.align_level(level, alive[i].tf, &alive[i].score); };
+        if (parallel)
         {
-        centroid_x += mesh_pc_->points[i].x;
-        centroid_y += mesh_pc_->points[i].y;
-        centroid_z += mesh_pc_->points[i].z;
+            parallel_for_(alive.size(), body);
         }
+        else
+        {
+            for (size_t i = 0; i < alive.size(); ++i)
+                body(i);
+        }
+
+        // most of the part has to be explained first, the error breaks ties
+        std::sort(alive.begin(), alive.end(), [](const Hypothesis &a, const Hypothesis &b) {
+            if (a.score.inlier_ratio != b.score.inlier_ratio)
+                return a.score.inlier_ratio > b.score.inlier_ratio;
+            return a.score.fitness < b.score.fitness;
+        });
+        double min_ratio = alive.front().score.inlier_ratio * hypothesis_keep_ratio_;
+        size_t keep = 1;
+        while (keep < alive.size() && alive[keep].score.inlier_ratio >= min_ratio)
+            ++keep;
+        alive.resize(keep);
 
-        centroid_x /= mesh_pc_->points.size();
-        centroid_y /= mesh_pc_->points.size();
-        centroid_z /= mesh_pc_->points.size();
+        pose.tf = alive.front().tf;
+        pose.fitness = alive.front().score.fitness;
+        if (progress && !progress(level + 1, icp.level_count(), pose.tf, pose.fitness))
+        {
+            pose.complete = false;
+            return;
+        }
+    }
 
-        std::cout << centroid_x << " " << centroid_y << " " << centroid_z << "\n";
+    ROS_INFO("Best of %zu hypotheses for %s: %.0f%% inliers, fitness %g", started,
+             name.c_str(), alive.front().score.inlier_ratio * 100.0, pose.fitness);
+}
 
-        for (int i = 0; i < mesh_pc_->points.size(); i++)
+void ICP::align_levels_(const PyramidICP &icp, const Progress &progress, ObjectPose &pose)
+{
+    ICPScore score{std::numeric_limits<double>::max(), 0.0};
+    for (size_t level = 0; level < icp.level_count(); ++level)
+    {
+        bool last = level + 1 == icp.level_count();
+        pose.tf = icp.align_level(level, pose.tf, progress || last ? &score : nullptr);
+        if (progress || last)
+            pose.fitness = score.fitness;
+        if (progress && !progress(level + 1, icp.level_count(), pose.tf, pose.fitness))
         {
-            mesh_pc_->points[i].x -= centroid_x;
-            mesh_pc_->points[i].y -= centroid_y;
-            mesh_pc_->points[i].z -= centroid_z;
+            pose.complete = false;
+            return;
         }
+    }
+}
+
+ICP::ObjectPose ICP::register_model_(const MeshModelConstPtr &model, bool parallel, const Progress &progress)
+{
+    ObjectPose pose{TFMatrix::Identity(), 0.0, true};
+    ros::WallTime start = ros::WallTime::now();
+
+    bool have_guess = false;
+    if (feature_aligner_)
+    {
+        double inliers = 0.0;
+        have_guess = feature_aligner_->align(model, pose.tf, &inliers);
+        if (have_guess)
+            ROS_INFO("Feature alignment for %s: %.0f%% inliers in %.1f ms", model->name.c_str(), inliers * 100.0,
+                     (ros::WallTime::now() - start).toSec() * 1000.0);
+        else
+            ROS_WARN("Feature alignment for %s failed, starting ICP from identity", model->name.c_str());
+    }
+
+    // the stages only hold the scene levels here, each object voxelizes
+    // itself into a copy so several can be registered at once
+    if (have_guess && !refine_.icp.empty())
+    {
+        // close to the answer already, only the fine levels are needed
+        PyramidICP icp = refine_.icp;
+        icp.set_source(model->cloud, model->cloud_normals);
+        align_levels_(icp, progress, pose);
+    }
+    else if (!pyramid_.icp.empty())
+    {
+        PyramidICP icp = pyramid_.icp;
+        icp.set_source(model->cloud, model->cloud_normals);
+        align_hypotheses_(icp, model->name, parallel, progress, pose);
+    }
+    else
+    {
+        PointCloudPtr cloud(new PointCloud);
+        pcl::transformPointCloud(*model->cloud, *cloud, pose.tf);
+        for (int i = 0; i < 10; i++)
+        {
+            pcl::IterativeClosestPoint<ICP::Point, ICP::Point> icp;
+            set_icp_params_(icp);
+            icp.setInputSource(cloud);
+            icp.setInputTarget(scene_pc_);
+            set_scene_search_(icp);
+            icp.align(*cloud);
+            pose.tf = icp.getFinalTransformation() * pose.tf;
+            pose.fitness = score_scene_(*cloud).fitness;
+            if (progress && !progress(i + 1, 10, pose.tf, pose.fitness))
+            {
+                pose.complete = false;
+                break;
+            }
+        }
+    }
+    return pose;
+}
+
+void ICP::set_icp_params_(pcl::IterativeClosestPoint<Point, Point> &icp) const
+{
+    icp.setMaxCorrespondenceDistance(max_corresp_dist_);
+    icp.setTransformationEpsilon(transf_epsilon_);
+    icp.setEuclideanFitnessEpsilon(fitness_epsilon_);
+    icp.setMaximumIterations(static_cast<int>(max_iter_));
+}
+
+void ICP::crop_to_model_(const PointCloud &scene, PointCloud &roi) const
+{
+    // world aligned box around the model's box at the current pose
+    Eigen::Vector3f lo = Eigen::Vector3f::Constant(std::numeric_limits<float>::max());
+    Eigen::Vector3f hi = -lo;
+    for (int c = 0; c < 8; ++c)
+    {
+        Eigen::Vector3f corner((c & 1) ? model_max_.x() : model_min_.x(), (c & 2) ? model_max_.y() : model_min_.y(),
+                               (c & 4) ? model_max_.z() : model_min_.z());
+        Eigen::Vector3f p = tf_.topLeftCorner<3, 3>() * corner + tf_.topRightCorner<3, 1>();
+        lo = lo.cwiseMin(p);
+        hi = hi.cwiseMax(p);
+    }
+    lo.array() -= tracking_margin_;
+    hi.array() += tracking_margin_;
+
+    roi.clear();
+    for (const Point &p : scene.points)
+    {
+        if (p.x >= lo.x() && p.x <= hi.x() && p.y >= lo.y() && p.y <= hi.y() && p.z >= lo.z() && p.z <= hi.z())
+            roi.push_back(p);
+    }
+    roi.header = scene.header;
+}
+
+void ICP::track_()
+{
+    if (tracked_generation_ == scene_generation_)
+    {
+        // nothing new to align against, keep the frame alive
+        broadcast_tf_(mesh_name_, tf_);
+        return;
+    }
+    tracked_generation_ = scene_generation_;
 
+    ros::WallTime start = ros::WallTime::now();
+    if (tracking_.model != model_)
+    {
+        tracking_.icp.set_source(model_->cloud);
+        tracking_.model = model_;
+        Eigen::Vector4f min_pt, max_pt;
+        pcl::getMinMax3D(*model_->cloud, min_pt, max_pt);
+        model_min_ = min_pt.head<3>();
+        model_max_ = max_pt.head<3>();
+    }
 
-        std::cout << "mesh_frame: " << mesh_pc_->header.frame_id << "\n";
+    PointCloudPtr roi(new PointCloud);
+    crop_to_model_(*scene_pc_, *roi);
+    if (static_cast<int>(roi->size()) < tracking_min_points_)
+    {
+        ROS_WARN_THROTTLE(5.0, "Only %zu scene points around %s, holding its pose", roi->size(), mesh_name_.c_str());
+        broadcast_tf_(mesh_name_, tf_);
+        return;
     }
+    tracking_.icp.set_target(roi);
+    tf_ = tracking_.icp.align(tf_, &fitness_);
+    pcl::transformPointCloud(*model_->cloud, *mesh_pc_, tf_);
+    publish_pose_();
+
+    double ms = (ros::WallTime::now() - start).toSec() * 1000.0;
+    tracking_ms_ = tracking_ms_ > 0.0 ? 0.9 * tracking_ms_ + 0.1 * ms : ms;
+    ROS_INFO_THROTTLE(10.0, "Tracking %s: %.2f ms per scene, %zu of %zu points", mesh_name_.c_str(), tracking_ms_,
+                      roi->size(), scene_pc_->size());
 }
 
 void ICP::run() {
+    // a service or action is registering, tracking resumes after it
+    std::unique_lock<std::mutex> lock(icp_mutex_, std::try_to_lock);
+    if (!lock.owns_lock() || !model_)
+        return;
+    update_scene_(mesh_name_);
     try
     {
-        if (scene_pc_->empty() || mesh_pc_->empty())
+        if (scene_pc_->empty())
         {
             return; 
         }
-        pcl::IterativeClosestPoint<ICP::Point, ICP::Point> icp;
-        icp.setInputSource(mesh_pc_);
-        icp.setInputTarget(scene_pc_);
-
-        icp.align(*mesh_pc_);
-
-        tf_ = icp.getFinalTransformation() * tf_;
-
-        tf::Transform transform;
-        std::string frame_id = mesh_name_ + "_frame";
-        geometry_msgs::TransformStamped tf;
-        Eigen::Quaternionf q(tf_.topLeftCorner<3, 3>());
-        transform.setOrigin(tf::Vector3(tf_.col(3)(0), tf_.col(3)(1), tf_.col(3)(2)));
-        transform.setRotation(tf::Quaternion(q.x(), q.y(), q.z(), q.w()));
-        tf.child_frame_id = frame_id;
-        tf.header.frame_id = base_frame_;
-        tf.header.stamp = ros::Time::now();
-        tf.transform.translation.x = tf_.col(3)(0);
-        tf.transform.translation.y = tf_.col(3)(1);
-        tf.transform.translation.z = tf_.col(3)(2);
-        tf.transform.rotation.x = q.x();
-        tf.transform.rotation.y = q.y();
-        tf.transform.rotation.z = q.z();
-        tf.transform.rotation.w = q.w();
-        br_.sendTransform(tf);
-
-        mesh_pc_->header.frame_id = base_frame_;
-        mesh_pub_.publish(mesh_pc_);
+        if (tracking_enabled_)
+        {
+            track_();
+        }
+        else if (!pyramid_.icp.empty())
+        {
+            tf_ = align_stage_(pyramid_, tf_);
+            pcl::transformPointCloud(*model_->cloud, *mesh_pc_, tf_);
+            publish_pose_();
+        }
+        else
+        {
+            pcl::IterativeClosestPoint<ICP::Point, ICP::Point> icp;
+            set_icp_params_(icp);
+            icp.setInputSource(mesh_pc_);
+            icp.setInputTarget(scene_pc_);
+            prepare_scene_search_();
+            set_scene_search_(icp);
+
+            icp.align(*mesh_pc_);
+
+            tf_ = icp.getFinalTransformation() * tf_;
+            fitness_ = score_scene_(*mesh_pc_).fitness;
+            publish_pose_();
+        }
     }
     catch(const std::exception& e)
     {
@@ -110,25 +609,238 @@ void ICP::run() {
     }
 }
 
+void ICP::broadcast_tf_(const std::string &mesh_name, const TFMatrix &tf_matrix)
+{
+    geometry_msgs::TransformStamped tf;
+    Eigen::Quaternionf q(tf_matrix.topLeftCorner<3, 3>());
+    tf.child_frame_id = mesh_name + "_frame";
+    tf.header.frame_id = base_frame_;
+    tf.header.stamp = ros::Time::now();
+    tf.transform.translation.x = tf_matrix.col(3)(0);
+    tf.transform.translation.y = tf_matrix.col(3)(1);
+    tf.transform.translation.z = tf_matrix.col(3)(2);
+    tf.transform.rotation.x = q.x();
+    tf.transform.rotation.y = q.y();
+    tf.transform.rotation.z = q.z();
+    tf.transform.rotation.w = q.w();
+    br_.sendTransform(tf);
+}
+
+void ICP::publish_pose_()
+{
+    broadcast_tf_(mesh_name_, tf_);
+
+    // publish a copy, mesh_pc_ keeps being aligned in place
+    mesh_pc_->header.frame_id = base_frame_;
+    PointCloudMsg::Ptr mesh_msg(new PointCloudMsg);
+    pcl::toROSMsg(*mesh_pc_, *mesh_msg);
+    mesh_pub_.publish(mesh_msg);
+}
+
+void ICP::fill_pose_(const std::string &mesh_name, const TFMatrix &tf, geometry_msgs::PoseStamped &pose)
+{
+    pose.header.frame_id = mesh_name + "_frame";
+    pose.header.stamp = ros::Time::now();
+    Eigen::Quaternionf q(tf.topLeftCorner<3, 3>());
+    pose.pose.position.x = tf.col(3)(0);
+    pose.pose.position.y = tf.col(3)(1);
+    pose.pose.position.z = tf.col(3)(2);
+    pose.pose.orientation.x = q.x();
+    pose.pose.orientation.y = q.y();
+    pose.pose.orientation.z = q.z();
+    pose.pose.orientation.w = q.w();
+}
+
+bool ICP::parse_method_(const std::string &name, ICPMethod &method) const
+{
+    method = default_method_;
+    if (!name.empty() && !parse_icp_method(name, method))
+    {
+        ROS_ERROR("Unknown ICP method %s", name.c_str());
+        return false;
+    }
+    if (method != ICPMethod::POINT_TO_POINT && pyramid_.icp.empty())
+        ROS_WARN("point_to_plane needs ~pyramid levels, running point to point ICP");
+    return true;
+}
+
 bool ICP::mesh_icp_srv(mars_msgs::ICPMeshTF::Request &req, mars_msgs::ICPMeshTF::Response &resp)
 {
-    set_mesh_(req.mesh_name);
-    tf_ = TFMatrix::Identity();
-    mesh_name_ = req.mesh_name;
-
-    std::cout << mesh_name_ << "\n"; 
-    for(int i = 0; i < 10; i++) {
-        run();
-    }
-    resp.tf.header.frame_id = mesh_name_ + "_frame";
-    resp.tf.header.stamp = ros::Time::now();
-    Eigen::Quaternionf q(tf_.topLeftCorner<3, 3>());
-    resp.tf.pose.position.x = tf_.col(3)(0);
-    resp.tf.pose.position.y = tf_.col(3)(1);
-    resp.tf.pose.position.z = tf_.col(3)(2);
-    resp.tf.pose.orientation.x = q.x();
-    resp.tf.pose.orientation.y = q.y();
-    resp.tf.pose.orientation.z = q.z();
-    resp.tf.pose.orientation.w = q.w();
+    std::lock_guard<std::mutex> lock(icp_mutex_);
+    // a bad request leaves the tracked mesh alone
+    ICPMethod method;
+    if (!parse_method_(req.method, method))
+        return false;
+    MeshModelConstPtr model = mesh_cache_->get(req.mesh_name);
+    if (!model)
+    {
+        ROS_ERROR("No model for mesh %s", req.mesh_name.c_str());
+        return false;
+    }
+    update_scene_(req.mesh_name);
+    method_ = method;
+    set_mesh_(req.mesh_name, model);
+
+    ros::WallTime start = ros::WallTime::now();
+    if (scene_pc_->empty())
+    {
+        // the timer starts tracking from identity once points arrive, but
+        // that is no registration
+        ROS_WARN("No scene points to register %s against", mesh_name_.c_str());
+        fitness_ = std::numeric_limits<double>::max();
+    }
+    else
+    {
+        prepare_scene_();
+        ObjectPose pose = register_model_(model_, true);
+        tf_ = pose.tf;
+        fitness_ = pose.fitness;
+        pcl::transformPointCloud(*model_->cloud, *mesh_pc_, tf_);
+        publish_pose_();
+        tracked_generation_ = scene_generation_;
+        last_poses_[mesh_name_] = tf_;
+    }
+    ROS_INFO("ICP for %s took %.1f ms", mesh_name_.c_str(), (ros::WallTime::now() - start).toSec() * 1000.0);
+
+    resp.fitness = fitness_;
+    fill_pose_(mesh_name_, tf_, resp.tf);
     return true;
-}
\ No newline at end of file
+}
+
+bool ICP::mesh_icp_batch_srv(mars_msgs::ICPMeshTFBatch::Request &req, mars_msgs::ICPMeshTFBatch::Response &resp)
+{
+    std::lock_guard<std::mutex> lock(icp_mutex_);
+    ICPMethod method;
+    if (!parse_method_(req.method, method))
+        return false;
+    // only for this call, the timer keeps tracking with its own method
+    ICPMethod tracking_method = method_;
+    method_ = method;
+
+    size_t n = req.mesh_names.size();
+    std::vector<MeshModelConstPtr> models(n);
+    for (size_t i = 0; i < n; ++i)
+    {
+        models[i] = mesh_cache_->get(req.mesh_names[i]);
+        if (!models[i])
+            ROS_ERROR("No model for mesh %s", req.mesh_names[i].c_str());
+    }
+
+    ros::WallTime start = ros::WallTime::now();
+    std::vector<ObjectPose> poses(n, ObjectPose{TFMatrix::Identity(), std::numeric_limits<double>::max(), true});
+    std::vector<bool> registered(n, false);
+    if (!labelled_topic_.empty())
+    {
+        // every object has its own scene, so objects run one after the
+        // other with their hypotheses on the pool
+        for (size_t i = 0; i < n; ++i)
+        {
+            if (!models[i])
+                continue;
+            update_scene_(req.mesh_names[i]);
+            if (scene_pc_->empty())
+                continue;
+            prepare_scene_();
+            poses[i] = register_model_(models[i], true);
+            registered[i] = true;
+        }
+    }
+    else
+    {
+        // the scene levels, normals, features and search trees are built
+        // once and shared read only by all objects. Objects run on the pool,
+        // their hypotheses serially, since pool tasks waiting on the same
+        // pool could leave no thread to run them.
+        update_scene_("");
+        if (!scene_pc_->empty())
+        {
+            prepare_scene_();
+            parallel_for_(n, [&](size_t i) {
+                if (models[i])
+                    poses[i] = register_model_(models[i], false);
+            });
+            for (size_t i = 0; i < n; ++i)
+                registered[i] = models[i] != nullptr;
+        }
+    }
+    method_ = tracking_method;
+    ROS_INFO("Batch ICP for %zu meshes took %.1f ms", n, (ros::WallTime::now() - start).toSec() * 1000.0);
+
+    resp.tfs.resize(n);
+    resp.fitness.resize(n);
+    resp.found.resize(n);
+    for (size_t i = 0; i < n; ++i)
+    {
+        const std::string &name = req.mesh_names[i];
+        resp.found[i] = registered[i];
+        resp.fitness[i] = poses[i].fitness;
+        fill_pose_(name, poses[i].tf, resp.tfs[i]);
+        if (registered[i])
+        {
+            last_poses_[name] = poses[i].tf;
+            broadcast_tf_(name, poses[i].tf);
+        }
+    }
+    return true;
+}
+
+void ICP::register_mesh_cb_(const mars_msgs::RegisterMeshGoalConstPtr &goal)
+{
+    // runs on the action server's thread, scene messages keep coming in on
+    // the main thread and the timer skips its passes until this is done
+    std::lock_guard<std::mutex> lock(icp_mutex_);
+    update_scene_(goal->mesh_name);
+
+    // nothing is changed until the goal can no longer abort, the timer
+    // keeps tracking the previous mesh otherwise
+    mars_msgs::RegisterMeshResult result;
+    MeshModelConstPtr model = mesh_cache_->get(goal->mesh_name);
+    if (!model)
+    {
+        register_action_->setAborted(result, "No model for mesh " + goal->mesh_name);
+        return;
+    }
+    ICPMethod method;
+    if (!parse_method_(goal->method, method))
+    {
+        register_action_->setAborted(result, "Unknown ICP method " + goal->method);
+        return;
+    }
+    if (scene_pc_->empty())
+    {
+        register_action_->setAborted(result, "No scene points");
+        return;
+    }
+    method_ = method;
+    set_mesh_(goal->mesh_name, model);
+
+    ros::WallTime start = ros::WallTime::now();
+    prepare_scene_();
+    ObjectPose pose = register_model_(model_, true, [&](size_t step, size_t steps, const TFMatrix &tf, double fitness) {
+        mars_msgs::RegisterMeshFeedback feedback;
+        fill_pose_(mesh_name_, tf, feedback.tf);
+        feedback.fitness = fitness;
+        feedback.step = step;
+        feedback.steps = steps;
+        register_action_->publishFeedback(feedback);
+        return !register_action_->isPreemptRequested() && ros::ok();
+    });
+
+    // a preempted pose is still the best so far, tracking continues from it
+    tf_ = pose.tf;
+    fitness_ = pose.fitness;
+    pcl::transformPointCloud(*model_->cloud, *mesh_pc_, tf_);
+    publish_pose_();
+    tracked_generation_ = scene_generation_;
+    result.fitness = fitness_;
+    fill_pose_(mesh_name_, tf_, result.tf);
+    ROS_INFO("register_mesh for %s %s after %.1f ms", mesh_name_.c_str(), pose.complete ? "finished" : "preempted",
+             (ros::WallTime::now() - start).toSec() * 1000.0);
+    if (!pose.complete)
+    {
+        register_action_->setPreempted(result);
+        return;
+    }
+    last_poses_[mesh_name_] = tf_;
+    register_action_->setSucceeded(result);
+}
@@ -0,0 +1,265 @@
+#include <mars_perception/icp_pyramid.h>
+#include <pcl/common/io.h>
+#include <pcl/features/normal_3d_omp.h>
+#include <pcl/filters/filter.h>
+#include <pcl/filters/voxel_grid.h>
+
+static bool read_number(XmlRpc::XmlRpcValue &value, const std::string &key, double &out)
+{
+  if (!value.hasMember(key))
+    return false;
+  XmlRpc::XmlRpcValue &v = value[key];
+  if (v.getType() == XmlRpc::XmlRpcValue::TypeDouble)
+    out = static_cast<double>(v);
+  else if (v.getType() == XmlRpc::XmlRpcValue::TypeInt)
+    out = static_cast<int>(v);
+  else
+    return false;
+  return true;
+}
+
+template <typename PointType>
+static typename pcl::PointCloud<PointType>::ConstPtr downsample(const typename pcl::PointCloud<PointType>::ConstPtr &cloud,
+                                                                double leaf_size)
+{
+  if (leaf_size <= 0.0)
+    return cloud;
+  typename pcl::PointCloud<PointType>::Ptr out(new pcl::PointCloud<PointType>);
+  pcl::VoxelGrid<PointType> voxel_filter;
+  voxel_filter.setInputCloud(cloud);
+  voxel_filter.setLeafSize(leaf_size, leaf_size, leaf_size);
+  voxel_filter.filter(*out);
+  return out;
+}
+
+bool parse_icp_method(const std::string &name, ICPMethod &method)
+{
+  if (name == "point_to_point")
+    method = ICPMethod::POINT_TO_POINT;
+  else if (name == "point_to_plane")
+    method = ICPMethod::POINT_TO_PLANE;
+  else
+    return false;
+  return true;
+}
+
+PyramidICP::PyramidICP()
+    : method_(ICPMethod::POINT_TO_POINT), fitness_epsilon_(0.0), normal_radius_(0.005), hash_cell_(0.0),
+      correspondence_threads_(1)
+{
+}
+
+PyramidICP::PyramidICP(const std::vector<ICPLevel> &levels, ICPMethod method)
+    : levels_(levels), method_(method), fitness_epsilon_(0.0), normal_radius_(0.005), hash_cell_(0.0),
+      correspondence_threads_(1)
+{
+}
+
+bool PyramidICP::load_levels(ros::NodeHandle &nh, const std::string &param, std::vector<ICPLevel> &levels)
+{
+  XmlRpc::XmlRpcValue list;
+  if (!nh.getParam(param, list))
+    return false;
+  if (list.getType() != XmlRpc::XmlRpcValue::TypeArray)
+  {
+    ROS_ERROR("%s must be a list of ICP levels", param.c_str());
+    return false;
+  }
+
+  levels.clear();
+  for (int i = 0; i < list.size(); ++i)
+  {
+    ICPLevel level;
+    double max_iterations = 0;
+    level.leaf_size = 0.0;
+    level.transformation_epsilon = 1e-8;
+    if (list[i].getType() != XmlRpc::XmlRpcValue::TypeStruct ||
+        !read_number(list[i], "max_correspondence_distance", level.max_correspondence_distance) ||
+        !read_number(list[i], "max_iterations", max_iterations))
+    {
+      ROS_ERROR("%s[%d] needs max_correspondence_distance and max_iterations", param.c_str(), i);
+      return false;
+    }
+    read_number(list[i], "leaf_size", level.leaf_size);
+    read_number(list[i], "transformation_epsilon", level.transformation_epsilon);
+    level.max_iterations = static_cast<int>(max_iterations);
+    levels.push_back(level);
+  }
+  return true;
+}
+
+void PyramidICP::set_levels(const std::vector<ICPLevel> &levels)
+{
+  levels_ = levels;
+  build_source_levels_();
+  build_target_levels_();
+}
+
+void PyramidICP::set_method(ICPMethod method)
+{
+  if (method == method_)
+    return;
+  method_ = method;
+  build_source_levels_();
+  build_target_levels_();
+}
+
+void PyramidICP::set_source(const PointCloudT::ConstPtr &source, const PointCloudNT::ConstPtr &source_normals)
+{
+  source_ = source;
+  source_normals_ = source_normals;
+  build_source_levels_();
+}
+
+void PyramidICP::set_target(const PointCloudT::ConstPtr &target, const SearchTree::Ptr &full_tree)
+{
+  target_ = target;
+  full_tree_ = full_tree;
+  build_target_levels_();
+}
+
+void PyramidICP::build_source_levels_()
+{
+  point_levels_.resize(levels_.size());
+  plane_levels_.resize(levels_.size());
+  for (size_t i = 0; i < levels_.size(); ++i)
+  {
+    point_levels_[i].source.reset();
+    plane_levels_[i].source.reset();
+    if (method_ == ICPMethod::POINT_TO_POINT && source_)
+    {
+      point_levels_[i].source = downsample<PointT>(source_, levels_[i].leaf_size);
+    }
+    else if (method_ == ICPMethod::POINT_TO_PLANE && source_normals_)
+    {
+      // voxels average the normals of their samples
+      PointCloudNT::Ptr level(new PointCloudNT(*downsample<PointNT>(source_normals_, levels_[i].leaf_size)));
+      for (auto &p : level->points)
+        p.getNormalVector3fMap().normalize();
+      plane_levels_[i].source = level;
+    }
+  }
+}
+
+void PyramidICP::build_target_levels_()
+{
+  point_levels_.resize(levels_.size());
+  plane_levels_.resize(levels_.size());
+  for (size_t i = 0; i < levels_.size(); ++i)
+  {
+    point_levels_[i].target.reset();
+    point_levels_[i].tree.reset();
+    point_levels_[i].hash.reset();
+    plane_levels_[i].target.reset();
+    plane_levels_[i].tree.reset();
+    plane_levels_[i].hash.reset();
+    if (!target_)
+      continue;
+
+    PointCloudT::ConstPtr cloud = downsample<PointT>(target_, levels_[i].leaf_size);
+    float cell = std::max(hash_cell_, levels_[i].leaf_size);
+    bool use_hash = hash_cell_ > 0.0 && VoxelHash::suits(cell, levels_[i].max_correspondence_distance);
+    if (method_ == ICPMethod::POINT_TO_POINT)
+    {
+      point_levels_[i].target = cloud;
+      if (use_hash)
+      {
+        point_levels_[i].hash = std::make_shared<VoxelHash>(*cloud, cell);
+      }
+      else if (levels_[i].leaf_size <= 0.0 && full_tree_)
+      {
+        point_levels_[i].tree = full_tree_;
+      }
+      else
+      {
+        point_levels_[i].tree.reset(new SearchTree);
+        point_levels_[i].tree->setInputCloud(cloud);
+      }
+    }
+    else
+    {
+      PointCloudNT::Ptr normals(new PointCloudNT);
+      pcl::copyPointCloud(*cloud, *normals);
+      pcl::NormalEstimationOMP<PointT, PointNT> estimator;
+      estimator.setInputCloud(cloud);
+      estimator.setRadiusSearch(std::max(normal_radius_, 2.5 * levels_[i].leaf_size));
+      // only writes the normal and curvature fields, xyz and color stay
+      estimator.compute(*normals);
+      std::vector<int> valid;
+      pcl::removeNaNNormalsFromPointCloud(*normals, *normals, valid);
+      plane_levels_[i].target = normals;
+      if (use_hash)
+      {
+        plane_levels_[i].hash = std::make_shared<VoxelHash>(*normals, cell);
+      }
+      else
+      {
+        plane_levels_[i].tree.reset(new pcl::search::KdTree<PointNT>);
+        plane_levels_[i].tree->setInputCloud(normals);
+      }
+    }
+  }
+}
+
+template <typename PointType, typename Registration>
+Eigen::Matrix4f PyramidICP::align_level_(const Level<PointType> &level, const ICPLevel &params,
+                                         const Eigen::Matrix4f &guess, ICPScore *score) const
+{
+  if (!level.source || !level.target || level.source->empty() || level.target->empty())
+  {
+    // nothing matched, e.g. point to plane without model normals
+    if (score)
+      *score = ICPScore{std::numeric_limits<double>::max(), 0.0};
+    return guess;
+  }
+
+  pcl::PointCloud<PointType> aligned;
+  Registration icp;
+  icp.setInputSource(level.source);
+  icp.setInputTarget(level.target);
+  if (level.hash)
+  {
+    // an empty tree, so ICP does not build one it would never search
+    icp.setCorrespondenceEstimation(typename Registration::CorrespondenceEstimationPtr(
+        new VoxelHashCorrespondence<PointType, PointType>(level.hash, correspondence_threads_)));
+    icp.setSearchMethodTarget(typename pcl::search::KdTree<PointType>::Ptr(new pcl::search::KdTree<PointType>), true);
+  }
+  else
+  {
+    icp.setSearchMethodTarget(level.tree, true);
+  }
+  icp.setMaxCorrespondenceDistance(params.max_correspondence_distance);
+  icp.setMaximumIterations(params.max_iterations);
+  icp.setTransformationEpsilon(params.transformation_epsilon);
+  icp.setEuclideanFitnessEpsilon(fitness_epsilon_);
+  icp.align(aligned, guess);
+
+  if (score)
+    *score = score_alignment(aligned, level.hash.get(), level.tree.get(), params.max_correspondence_distance);
+  return icp.getFinalTransformation();
+}
+
+Eigen::Matrix4f PyramidICP::align_level(size_t i, const Eigen::Matrix4f &guess, ICPScore *score) const
+{
+  if (method_ == ICPMethod::POINT_TO_PLANE)
+    return align_level_<PointNT, pcl::IterativeClosestPointWithNormals<PointNT, PointNT>>(plane_levels_[i], levels_[i],
+                                                                                          guess, score);
+  return align_level_<PointT, pcl::IterativeClosestPoint<PointT, PointT>>(point_levels_[i], levels_[i], guess, score);
+}
+
+Eigen::Matrix4f PyramidICP::align(const Eigen::Matrix4f &guess, double *fitness)
+{
+  Eigen::Matrix4f tf = guess;
+  level_times_.assign(levels_.size(), 0.0);
+  ICPScore score{std::numeric_limits<double>::max(), 0.0};
+  for (size_t i = 0; i < levels_.size(); ++i)
+  {
+    ros::WallTime start = ros::WallTime::now();
+    bool last = i + 1 == levels_.size();
+    tf = align_level(i, tf, last && fitness ? &score : nullptr);
+    level_times_[i] = (ros::WallTime::now() - start).toSec() * 1000.0;
+    if (last && fitness)
+      *fitness = score.fitness;
+  }
+  return tf;
+}
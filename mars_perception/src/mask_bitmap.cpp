@@ -0,0 +1,94 @@
+#include <mars_perception/mask_bitmap.h>
+#include <sensor_msgs/image_encodings.h>
+#include <algorithm>
+#include <cstring>
+
+// high bit of every nonzero byte, then those eight bits gathered into the
+// low byte, byte k of the word to bit k. Assumes a little endian host like
+// every platform ROS runs on.
+static inline uint64_t nonzero_bytes(uint64_t bytes)
+{
+  const uint64_t low7 = 0x7F7F7F7F7F7F7F7Full;
+  uint64_t high = (((bytes & low7) + low7) | bytes) & ~low7;
+  return ((high >> 7) * 0x0102040810204080ull) >> 56;
+}
+
+void MaskBitmap::reset(int width, int height)
+{
+  if (width != width_ || height != height_)
+  {
+    width_ = width;
+    height_ = height;
+    words_ = (width + 63) / 64;
+    bits_.assign(size_t(words_) * height, 0);
+  }
+  else if (top_ < bottom_)
+  {
+    std::fill(bits_.begin() + size_t(top_) * words_, bits_.begin() + size_t(bottom_) * words_, 0);
+  }
+  top_ = bottom_ = 0;
+}
+
+void MaskBitmap::merge(const MaskBitmap &other)
+{
+  if (other.empty())
+    return;
+  for (size_t i = size_t(other.top_) * words_; i < size_t(other.bottom_) * words_; ++i)
+    bits_[i] |= other.bits_[i];
+  top_ = empty() ? other.top_ : std::min(top_, other.top_);
+  bottom_ = std::max(bottom_, other.bottom_);
+}
+
+void MaskBitmap::subtract(const MaskBitmap &other)
+{
+  const int top = std::max(top_, other.top_);
+  const int bottom = std::min(bottom_, other.bottom_);
+  for (size_t i = size_t(top) * words_; i < size_t(std::max(top, bottom)) * words_; ++i)
+    bits_[i] &= ~other.bits_[i];
+}
+
+bool MaskBitmap::add(const sensor_msgs::Image &mask, int x, int y, int width, int height)
+{
+  if ((mask.encoding != sensor_msgs::image_encodings::MONO8 && mask.encoding != sensor_msgs::image_encodings::TYPE_8UC1) ||
+      int(mask.width) != width_ || int(mask.height) != height_ || mask.data.size() < size_t(mask.step) * mask.height)
+    return false;
+
+  // eight pixel steps from a multiple of eight, so each lands in one byte of
+  // a bitmap word; the pixels this adds left of the box are the mask's own
+  int u_begin = std::max(0, x) & ~7;
+  int u_end = std::min(width_, x + width);
+  int v_begin = std::max(0, y);
+  int v_end = std::min(height_, y + height);
+  if (u_begin >= u_end || v_begin >= v_end)
+    return true;
+  if (top_ >= bottom_)
+  {
+    top_ = v_begin;
+    bottom_ = v_end;
+  }
+  else
+  {
+    top_ = std::min(top_, v_begin);
+    bottom_ = std::max(bottom_, v_end);
+  }
+
+  const int u_full = u_begin + ((u_end - u_begin) & ~7);
+  for (int v = v_begin; v < v_end; ++v)
+  {
+    const uint8_t *pixels = &mask.data[size_t(v) * mask.step];
+    uint64_t *row = &bits_[size_t(v) * words_];
+    for (int u = u_begin; u < u_full; u += 8)
+    {
+      uint64_t bytes;
+      std::memcpy(&bytes, pixels + u, sizeof(bytes));
+      if (bytes)
+        row[u >> 6] |= nonzero_bytes(bytes) << (u & 63);
+    }
+    for (int u = u_full; u < u_end; ++u)
+    {
+      if (pixels[u])
+        row[u >> 6] |= uint64_t(1) << (u & 63);
+    }
+  }
+  return true;
+}
@@ -1,294 +1,373 @@
 #include <mars_perception/mask_depth.h>
 
-MaskDepth::MaskDepth() : nh_(), tf_listener_(), concat_masked_cloud_(new PointCloudT)
+MaskDepth::MaskDepth(ros::NodeHandle &nh, ros::NodeHandle &pnh)
+    : nh_(nh), pnh_(pnh), cam_cnt_(0), sparse_(true), worker_threads_(1), tf_listener_(), icp_enabled_(false)
 {
     // global
     ros::param::get("/base_frame", base_frame_id_);
 
+    double extrinsics_timeout = 0.0;
+    double sync_max_interval = 0.1;
+    double camera_timeout = 1.0;
+    pnh_.getParam("extrinsics_timeout", extrinsics_timeout);
+    pnh_.getParam("sync_max_interval", sync_max_interval);
+    pnh_.getParam("camera_timeout", camera_timeout);
+    pnh_.getParam("worker_threads", worker_threads_);
+    pnh_.getParam("sparse_deprojection", sparse_);
+    extrinsics_.reset(new ExtrinsicsCache(nh_, tf_listener_, base_frame_id_, extrinsics_timeout));
+    max_interval_ = ros::Duration(sync_max_interval);
+    camera_timeout_ = ros::Duration(camera_timeout);
+
     std::vector<std::string> cameras_ns;
-    ros::param::get("/camera_ns", cameras_ns);
+    pnh_.getParam("camera_ns", cameras_ns);
+    ros::param::get("/detect_class_names", detect_names_);
 
-    std::string depth_topic;
-    std::vector<std::string> depth_topics;
+    // same topic layout as detect_mask_node
+    std::string depth_topic, color_topic, mask_topic;
     ros::param::get("/depth_topic", depth_topic);
-    for (std::string t : cameras_ns)
-        depth_topics.push_back(t + depth_topic);
-
-    std::string color_topic;
     ros::param::get("/color_topic", color_topic);
-    for (std::string t : cameras_ns)
-        depth_topics.push_back(t + color_topic);
-
-    std::string mask_topic;
-    std::vector<std::string> mask_topics;
     ros::param::get("/mask_topic", mask_topic);
-    for (std::string t : cameras_ns)
-        mask_topics.push_back(t + mask_topic);
 
-    std::string masked_points_topic; 
-    ros::param::get("/masked_points_topic", masked_points_topic);
-    ros::param::get("/camera_image_sizes", img_sizes_);
+    std::string masked_points_topic = "/masked_points";
+    pnh_.getParam("masked_points_topic", masked_points_topic);
 
     // box filter params
-    ros::param::get("~box_min", box_min_);
-    ros::param::get("~box_max", box_max_);
-    ros::param::get("~leaf_sizes", leaf_sizes_);
+    pnh_.getParam("box_min", box_min_);
+    pnh_.getParam("box_max", box_max_);
 
     // ICP params
-    ros::param::get("~max_correspondence_distance", max_corresp_dist_);
-    ros::param::get("~transformation_epsilon", transf_epsilon_);
-    ros::param::get("~fitness_epsilon", fitness_epsilon_);
-    ros::param::get("~max_iterations", max_iter_);
-    ros::param::get("~ransac_rejection_threshold", reject_thres_);
-
-    if (depth_topics.size() != CAM_CNT || mask_topics.size() != CAM_CNT)
-    {
-        ROS_ERROR("The size of camera_topics must be between 2");
-        ros::shutdown();
-    }
-
-    for (size_t i = 0; i < CAM_CNT; ++i)
+    pnh_.getParam("icp_enabled", icp_enabled_);
+    pnh_.getParam("max_correspondence_distance", max_corresp_dist_);
+    pnh_.getParam("transformation_epsilon", transf_epsilon_);
+    pnh_.getParam("fitness_epsilon", fitness_epsilon_);
+    pnh_.getParam("max_iterations", max_iter_);
+    pnh_.getParam("ransac_rejection_threshold", reject_thres_);
+
+    cam_cnt_ = cameras_ns.size();
+    if (cam_cnt_ == 0)
     {
-        depth_subs_[i] =
-            new message_filters::Subscriber<ImageT>(nh_, depth_topics[i], 10);
+        ROS_ERROR("camera_ns must list at least one camera");
+        return;
     }
-    depth_sync_ = new message_filters::Synchronizer<SyncPolicyT>(
-        SyncPolicyT(10), *depth_subs_[0], *depth_subs_[1], *depth_subs_[2]);
-    depth_sync_->registerCallback(
-        boost::bind(&MaskDepth::depth_image_cb, this, _1, _2, _3));
+    camera_clouds_.resize(cam_cnt_);
+    camera_headers_.resize(cam_cnt_);
 
-    for (size_t i = 0; i < CAM_CNT; ++i)
+    if (worker_threads_ <= 0)
+        worker_threads_ = cam_cnt_;
+    if (worker_threads_ > 1)
     {
-        color_subs_[i] =
-            new message_filters::Subscriber<ImageT>(nh_, color_topics[i], 10);
+        worker_pool_.reset(new boost::asio::thread_pool(worker_threads_));
     }
-    color_sync_ = new message_filters::Synchronizer<SyncPolicyT>(
-        SyncPolicyT(10), *color_subs_[0], *color_subs_[1], *color_subs_[2]);
-    color_sync_->registerCallback(
-        boost::bind(&MaskDepth::color_image_cb, this, _1, _2, _3));
 
-    for (size_t i = 0; i < CAM_CNT; ++i)
-    {
-        info_subs_[i] =
-            new message_filters::Subscriber<ImageT>(nh_, color_topics[i], 10);
-    }
-    color_sync_ = new message_filters::Synchronizer<SyncPolicyT>(
-        SyncPolicyT(10), *color_subs_[0], *color_subs_[1], *color_subs_[2]);
-    color_sync_->registerCallback(
-        boost::bind(&MaskDepth::color_image_cb, this, _1, _2, _3));
+    cloud_publisher_ = nh_.advertise<PointCloudMsgT>(masked_points_topic, 1);
 
-    for (size_t i = 0; i < CAM_CNT; ++i)
+    for (size_t i = 0; i < cam_cnt_; ++i)
     {
-        mask_subs_[i] =
-            new message_filters::Subscriber<Result>(nh_, mask_topics[i], 10);
+        const std::string &t = cameras_ns[i];
+        std::unique_ptr<Camera> cam(new Camera);
+        cam->rays = std::make_shared<RayTable>();
+        cam->busy = false;
+        cam->depth_sub.subscribe(nh_, "/" + t + "/camera/" + depth_topic, 10);
+        cam->color_sub.subscribe(nh_, "/" + t + "/camera/" + color_topic, 10);
+        cam->mask_sub.subscribe(nh_, "/" + t + "/" + mask_topic, 10);
+        cam->sync.reset(new message_filters::Synchronizer<BundlePolicy>(BundlePolicy(10), cam->depth_sub,
+                                                                         cam->color_sub, cam->mask_sub));
+        cam->sync->setMaxIntervalDuration(max_interval_);
+        cam->sync->registerCallback(boost::bind(&MaskDepth::bundle_cb, this, i, _1, _2, _3));
+        cam->info_sub = nh_.subscribe<InfoT>(
+            "/" + t + "/camera/" + color_topic.substr(0, color_topic.find('/')) + "/camera_info", 1,
+            boost::bind(&MaskDepth::info_cb, this, i, _1));
+        cameras_.push_back(std::move(cam));
     }
-    mask_sync_ = new message_filters::Synchronizer<SyncPolicyT>(
-        SyncPolicyT(10), *mask_subs_[0], *mask_subs_[1], *mask_subs_[2]);
-    mask_sync_->registerCallback(
-        boost::bind(&MaskDepth::mask_cb, this, _1, _2, _3));
-
-    cloud_publisher_ = nh_.advertise<PointCloudMsgT>(masked_points_topic, 1);
 }
 
-void MaskDepth::mask_cb(const Result::ConstPtr &msg1, const Result::ConstPtr &msg2, const Result::ConstPtr &msg3)
+void MaskDepth::info_cb(size_t i, const InfoT::ConstPtr &msg)
 {
-    std::vector<ImageT> masks[CAM_CNT] = {msg1->masks, msg2->masks, msg3->masks};
-    for(int i = 0; i < masks.size(); i++) {
-        masks_[i] = cv::Mat::zeros(cv::Size((double)img_sizes_[i][0],(double)img_sizes_[i][1]), CV_8UC3);
-
-        for(int j = 0; i < masks[i].size(); j++) {
-            cv_bridge::CvImagePtr cv_ptr;
-            try
-            {
-                cv_ptr = cv_bridge::toCvCopy(masks[i][j]);
-            }
-            catch (cv_bridge::Exception& e)
-            {
-                ROS_ERROR("cv_bridge exception: %s", e.what());
-                return;
-            }
-            masks_[i] = cv::bitwise_or(cv_ptr->image,masks_[i]);
-        }
-    } 
+    image_geometry::PinholeCameraModel model;
+    model.fromCameraInfo(msg);
+    RayTable rays = *std::atomic_load(&cameras_[i]->rays);
+    if (rays.update(model))
+        std::atomic_store(&cameras_[i]->rays, std::make_shared<const RayTable>(rays));
 }
 
-void MaskDepth::info_cb(const InfoT::ConstPtr &msg1, const InfoT::ConstPtr &msg2, const InfoT::ConstPtr &msg3)
+void MaskDepth::bundle_cb(size_t i, const ImageT::ConstPtr &depth, const ImageT::ConstPtr &color,
+                          const Result::ConstPtr &mask)
 {
-    std::vector<ImageT> masks[CAM_CNT] = {msg1->masks, msg2->masks, msg3->masks};
-    for(int i = 0; i < masks.size(); i++) {
-        masks_[i] = cv::Mat::zeros(cv::Size((double)img_sizes_[i][0],(double)img_sizes_[i][1]), CV_8UC3);
-
-        for(int j = 0; i < masks[i].size(); j++) {
-            cv_bridge::CvImagePtr cv_ptr;
-            try
-            {
-                cv_ptr = cv_bridge::toCvCopy(masks[i][j]);
-            }
-            catch (cv_bridge::Exception& e)
-            {
-                ROS_ERROR("cv_bridge exception: %s", e.what());
-                return;
-            }
-            masks_[i] = cv::bitwise_or(cv_ptr->image,masks_[i]);
-        }
-    } 
+    Camera &cam = *cameras_[i];
+    // the nodelet may run info_cb on another thread, the copy keeps this
+    // bundle's table alive
+    std::shared_ptr<const RayTable> rays = std::atomic_load(&cam.rays);
+    if (rays->width() == 0)
+        return;
+
+    if (!worker_pool_)
+    {
+        process_bundle(i, *rays, depth, color, mask);
+        return;
+    }
+    if (cam.busy.exchange(true))
+        return;
+    boost::asio::post(*worker_pool_, [this, i, rays, depth, color, mask]() {
+        process_bundle(i, *rays, depth, color, mask);
+        cameras_[i]->busy = false;
+    });
 }
 
-void MaskDepth::depth_image_cb(const Result::ConstPtr &msg1, const Result::ConstPtr &msg2, const Result::ConstPtr &msg3)
+void MaskDepth::process_bundle(size_t i, const RayTable &rays, const ImageT::ConstPtr &depth,
+                               const ImageT::ConstPtr &color, const Result::ConstPtr &mask)
 {
-    ImageT depth[CAM_CNT] = {msg1->masks, msg2->masks, msg3->masks};
-    for(int i = 0; i < depth.size(); i++) {
-        cv_bridge::CvImagePtr cv_ptr;
-        try
-        {
-            cv_ptr = cv_bridge::toCvCopy(depth[i][j]);
-        }
-        catch (cv_bridge::Exception& e)
-        {
-            ROS_ERROR("cv_bridge exception: %s", e.what());
+    PointCloudT::Ptr cloud(new PointCloudT);
+    try
+    {
+        if (!deproject_camera(i, rays, depth, color, mask, cloud))
             return;
-        }
-        cv::bitwise_and(cv_ptr->image,masks_[i]);
-        masked_depth_[i] = cv_ptr->toImageMsg();
-    } 
+    }
+    catch (tf::TransformException &ex)
+    {
+        ROS_ERROR("%s", ex.what());
+        return;
+    }
+    merge(i, depth->header, cloud);
 }
 
-void MaskDepth::color_image_cb(const Result::ConstPtr &msg1, const Result::ConstPtr &msg2, const Result::ConstPtr &msg3)
+void MaskDepth::decode_mask(size_t i, const Result::ConstPtr &msg, int width, int height)
 {
-    ImageT color[CAM_CNT] = {msg1->masks, msg2->masks, msg3->masks};
-    for(int i = 0; i < color.size(); i++) {
-        cv_bridge::CvImagePtr cv_ptr;
-        try
+    Camera &cam = *cameras_[i];
+    cam.mask.reset(width, height);
+    cam.runs.clear();
+    // a mask without a class name cannot be matched, boxes are optional
+    const size_t count = std::min(msg->masks.size(), msg->class_names.size());
+    if (count < msg->masks.size())
+        ROS_WARN_THROTTLE(5.0, "%zu masks but %zu class names, dropping the unnamed masks", msg->masks.size(),
+                          msg->class_names.size());
+    for (size_t j = 0; j < count; j++)
+    {
+        auto name = std::find(detect_names_.begin(), detect_names_.end(), msg->class_names[j]);
+        if (name == detect_names_.end())
+            continue;
+
+        // the box bounds the pixels read, without one the whole mask is
+        int x = 0, y = 0, w = width, h = height;
+        if (j < msg->boxes.size() && msg->boxes[j].width > 0 && msg->boxes[j].height > 0)
         {
-            cv_ptr = cv_bridge::toCvCopy(color[i][j]);
+            const sensor_msgs::RegionOfInterest &roi = msg->boxes[j];
+            x = roi.x_offset;
+            y = roi.y_offset;
+            w = roi.width;
+            h = roi.height;
         }
-        catch (cv_bridge::Exception& e)
+        cam.instance.reset(width, height);
+        if (!cam.instance.add(msg->masks[j], x, y, w, h))
         {
-            ROS_ERROR("cv_bridge exception: %s", e.what());
-            return;
+            ROS_WARN_THROTTLE(5.0, "%s mask does not match its %dx%d depth frame", msg->class_names[j].c_str(), width,
+                              height);
+            continue;
         }
-        cv::bitwise_and(cv_ptr->image, masks_[i]);
-        masked_color_[i] = cv_ptr->toImageMsg();
-    } 
+
+        // a pixel in several masks goes to the first instance
+        cam.instance.subtract(cam.mask);
+        cam.mask.merge(cam.instance);
+        uint32_t label = make_instance_label(name - detect_names_.begin(), i, j);
+        cam.instance.for_each_run(
+            [&](int v, int u_begin, int u_end) { cam.runs.push_back(PixelRun{v, u_begin, u_end, label}); });
+    }
 }
 
-void MaskDepth::convert()
+bool MaskDepth::deproject_camera(size_t i, const RayTable &rays, const ImageT::ConstPtr &depth,
+                                 const ImageT::ConstPtr &color, const Result::ConstPtr &mask,
+                                 const PointCloudT::Ptr &cloud)
 {
-    PointCloudT::Ptr masked_clouds[CAM_CNT];
-    concat_masked_cloud_ = PointCloudT::Ptr(new PointCloudT);
-
-    // to point cloud 
-    try
+    if (color->encoding != sensor_msgs::image_encodings::RGB8 ||
+        color->width != depth->width || color->height != depth->height ||
+        rays.width() != int(depth->width) || rays.height() != int(depth->height))
+        return false;
+    const bool depth_16u = depth->encoding == sensor_msgs::image_encodings::TYPE_16UC1;
+    if (!depth_16u && depth->encoding != sensor_msgs::image_encodings::TYPE_32FC1)
+        return false;
+
+    Camera &cam = *cameras_[i];
+    decode_mask(i, mask, depth->width, depth->height);
+    // no detection leaves the camera empty, but it still takes part in the
+    // merge
+    if (cam.mask.empty())
+        return true;
+
+    if (sparse_)
     {
-        for (size_t i = 0; i < CAM_CNT; ++i)
+        if (depth_16u)
+            runs_to_pointcloud<uint16_t>(depth, color, cam.runs, cloud, rays);
+        else
+            runs_to_pointcloud<float>(depth, color, cam.runs, cloud, rays);
+    }
+    else
+    {
+        if (depth_16u)
+            depth_to_pointcloud<uint16_t>(depth, color, cam.mask, cloud, rays);
+        else
+            depth_to_pointcloud<float>(depth, color, cam.mask, cloud, rays);
+        // labels only where the mask is, the rest of the frame keeps 0
+        for (const PixelRun &run : cam.runs)
         {
-            masked_clouds[i] = PointCloudT().makeShared();
-            depth_to_pointcloud(masked_depth_[i], masked_color_[i], masked_clouds[i])
-
-            tf_listener_.waitForTransform(base_frame_id_, masked_depth_[i].header.frame_id, ros::Time(0), ros::Duration(1.0));
-            pcl_ros::transformPointCloud(base_frame_id_, ros::Time(0), *masked_clouds[i], msgs[i]->header.frame_id, *masked_clouds[i], tf_listener_);
-
-            // if (masked_clouds[i]->size() != 0)
-            // {
-            //     pcl::VoxelGrid<PointT> voxel_filter;
-            //     pcl::CropBox<PointT> box_filter;
-            //     box_filter.setInputCloud(masked_clouds[i]);
+            for (int u = run.u_begin; u < run.u_end; ++u)
+                cloud->at(u, run.v).label = run.label;
+        }
+    }
 
-            //     box_filter.setMin(Eigen::Vector4f(box_min_[0], box_min_[1], box_min_[2], 1.0));
-            //     box_filter.setMax(Eigen::Vector4f(box_max_[0], box_max_[1], box_max_[2], 1.0));
-            //     box_filter.filter(*masked_clouds[i]);
+    pcl::transformPointCloud(*cloud, *cloud, extrinsics_->lookup(depth->header.frame_id));
+    return true;
+}
 
-            //     voxel_filter.setInputCloud(masked_clouds[i]);
-            //     voxel_filter.setLeafSize((double)leaf_sizes_[i][0], (double)leaf_sizes_[i][1], (double)leaf_sizes_[i][2]);
-            //     voxel_filter.filter(*masked_clouds[i]);
-            // }
+void MaskDepth::merge(size_t i, const std_msgs::Header &header, const PointCloudT::Ptr &cloud)
+{
+    std::vector<PointCloudT::Ptr> masked_clouds;
+    std_msgs::Header newest = header;
+    {
+        std::lock_guard<std::mutex> lock(merge_mutex_);
+        camera_clouds_[i] = cloud;
+        camera_headers_[i] = header;
+        for (size_t j = 0; j < cam_cnt_; ++j)
+        {
+            if (camera_clouds_[j] && camera_headers_[j].stamp > newest.stamp)
+                newest = camera_headers_[j];
+        }
+        for (size_t j = 0; j < cam_cnt_; ++j)
+        {
+            ros::Duration age = newest.stamp - camera_headers_[j].stamp;
+            if (camera_clouds_[j] && age <= max_interval_)
+                masked_clouds.push_back(camera_clouds_[j]);
+            // a camera lagging behind is replaced by its next bundle, one
+            // that went silent is not waited for
+            else if (!camera_headers_[j].stamp.isZero() && age <= camera_timeout_)
+                return;
+        }
+        camera_clouds_.assign(cam_cnt_, PointCloudT::Ptr());
+    }
 
+    // merge points, serially as this may already run on a pool thread
+    if (icp_enabled_ && masked_clouds[0]->size() != 0)
+    {
+        pcl::search::KdTree<PointT>::Ptr target_tree(new pcl::search::KdTree<PointT>);
+        target_tree->setInputCloud(masked_clouds[0]);
+        for (size_t j = 1; j < masked_clouds.size(); ++j)
+        {
+            if (masked_clouds[j]->size() == 0)
+                continue;
+            pcl::IterativeClosestPoint<PointT, PointT> icp;
+            icp.setInputSource(masked_clouds[j]);
+            icp.setInputTarget(masked_clouds[0]);
+            icp.setSearchMethodTarget(target_tree, true);
+            icp.setMaxCorrespondenceDistance(max_corresp_dist_);
+            icp.setMaximumIterations(max_iter_);
+            icp.setTransformationEpsilon(transf_epsilon_);
+            icp.setRANSACOutlierRejectionThreshold(reject_thres_);
+            icp.setEuclideanFitnessEpsilon(fitness_epsilon_);
+            icp.align(*masked_clouds[j]);
         }
     }
-    catch (tf::TransformException &ex)
+    PointCloudT::Ptr concat_masked_cloud(new PointCloudT);
+    for (const PointCloudT::Ptr &masked : masked_clouds)
     {
-        ROS_ERROR("%s", ex.what());
-        return;
+        *concat_masked_cloud += *masked;
     }
+    if (concat_masked_cloud->empty())
+        return;
+
+    // Publish
+    concat_masked_cloud->header = pcl_conversions::toPCL(newest);
+    concat_masked_cloud->header.frame_id = base_frame_id_;
+    PointCloudMsgT::Ptr output(new PointCloudMsgT);
+    pcl::toROSMsg(*concat_masked_cloud, *output);
+    cloud_publisher_.publish(output);
+}
 
-    // merge points
-    for (size_t i = 0; i < CAM_CNT; ++i)
+template <typename T>
+void MaskDepth::depth_to_pointcloud(const ImageT::ConstPtr &depth_msg,
+                                    const ImageT::ConstPtr &rgb_msg,
+                                    const MaskBitmap &mask,
+                                    const PointCloudT::Ptr &cloud,
+                                    const RayTable &rays)
+{
+    typedef depth_image_proc::DepthTraits<T> DepthTraits;
+    const float depth_scale = DepthTraits::toMeters(T(1));
+
+    cloud->width = depth_msg->width;
+    cloud->height = depth_msg->height;
+    cloud->is_dense = false;
+    cloud->resize(cloud->width * cloud->height);
+
+    // whole frames are bound by writing the points, so the table is used
+    // inline rather than through a row buffer
+    const float *ray_x = rays.x();
+    const float bad_point = std::numeric_limits<float>::quiet_NaN();
+    PointCloudT::iterator pt = cloud->begin();
+    for (int v = 0; v < int(cloud->height); ++v)
     {
-        if (masked_clouds_[i]->size() != 0)
+        const T *depth_row = reinterpret_cast<const T *>(&depth_msg->data[v * depth_msg->step]);
+        const uint8_t *rgb = &rgb_msg->data[v * rgb_msg->step];
+        const float ray_y = rays.y(v);
+        for (int u = 0; u < int(cloud->width); ++u, rgb += RGB8_COLOR_STEP, ++pt)
         {
-            if (i != 0)
-            {
-                pcl::IterativeClosestPoint<PointT, PointT> icp;
-                icp.setInputSource(masked_clouds[i]);
-                icp.setInputTarget(masked_clouds[0]);
-                icp.setMaxCorrespondenceDistance(max_corresp_dist_);
-                icp.setMaximumIterations(max_iter_);
-                icp.setTransformationEpsilon(transf_epsilon_);
-                icp.setRANSACOutlierRejectionThreshold(reject_thres_);
-                icp.setEuclideanFitnessEpsilon(fitness_epsilon_);
-                icp.align(*masked_clouds[i]);
-            }
-            *concat_masked_cloud_ += *masked_clouds[i];
+            T depth = depth_row[u];
+            bool keep = mask.test(u, v) && DepthTraits::valid(depth) && depth != T(0);
+            float z = keep ? depth * depth_scale : bad_point;
+            pt->x = ray_x[u] * z;
+            pt->y = ray_y * z;
+            pt->z = z;
+            pt->a = 255;
+            pt->r = rgb[RGB8_RED_OFFSET];
+            pt->g = rgb[RGB8_GREEN_OFFSET];
+            pt->b = rgb[RGB8_BLUE_OFFSET];
+            pt->label = 0;
         }
     }
-    // Publish
-    concat_masked_cloud_->header = pcl_conversions::toPCL(masked_depth_[0].header);
-    concat_masked_cloud_->header.frame_id = base_frame_id_;
-    cloud_publisher_.publish(concat_masked_cloud_);
 }
 
+template <typename T>
+void MaskDepth::runs_to_pointcloud(const ImageT::ConstPtr &depth_msg,
+                                   const ImageT::ConstPtr &rgb_msg,
+                                   const std::vector<PixelRun> &runs,
+                                   const PointCloudT::Ptr &cloud,
+                                   const RayTable &rays)
+{
+    typedef depth_image_proc::DepthTraits<T> DepthTraits;
+    const float depth_scale = DepthTraits::toMeters(T(1));
 
-void MaskDepth::depth_to_pointcloud(const sensor_msgs::ImageConstPtr& depth_msg,
-                                      const sensor_msgs::ImageConstPtr& rgb_msg,
-                                      const PointCloudT::Ptr& cloud_msg, 
-                                      const image_geometry::PinholeModel& model) {
-                                           // Use correct principal point from calibration
-  float center_x = model.cx();
-  float center_y = model.cy();
-
-  // Combine unit conversion (if necessary) with scaling by focal length for computing (X,Y)
-  double unit_scaling = DepthTraits<T>::toMeters( T(1) );
-  float constant_x = unit_scaling / model.fx();
-  float constant_y = unit_scaling / model.fy();
-  float bad_point = std::numeric_limits<float>::quiet_NaN ();
-  
-  const T* depth_row = reinterpret_cast<const T*>(&depth_msg->data[0]);
-  int row_step = depth_msg->step / sizeof(T);
-  const uint8_t* rgb = &rgb_msg->data[0];
-  int rgb_skip = rgb_msg->step - rgb_msg->width * color_step;
-
-  sensor_msgs::PointCloud2Iterator<float> iter_x(*cloud_msg, "x");
-  sensor_msgs::PointCloud2Iterator<float> iter_y(*cloud_msg, "y");
-  sensor_msgs::PointCloud2Iterator<float> iter_z(*cloud_msg, "z");
-  sensor_msgs::PointCloud2Iterator<uint8_t> iter_r(*cloud_msg, "r");
-  sensor_msgs::PointCloud2Iterator<uint8_t> iter_g(*cloud_msg, "g");
-  sensor_msgs::PointCloud2Iterator<uint8_t> iter_b(*cloud_msg, "b");
-  sensor_msgs::PointCloud2Iterator<uint8_t> iter_a(*cloud_msg, "a");
-
-  for (int v = 0; v < int(cloud_msg->height); ++v, depth_row += row_step, rgb += RGB8_COLOR_STEP)
-  {
-    for (int u = 0; u < int(cloud_msg->width); ++u, rgb += color_step, ++iter_x, ++iter_y, ++iter_z, ++iter_a, ++iter_r, ++iter_g, ++iter_b)
+    size_t pixels = 0;
+    int longest = 0;
+    for (const PixelRun &run : runs)
     {
-      T depth = depth_row[u];
-
-      // Check for invalid measurements
-      if (!DepthTraits<T>::valid(depth))
-      {
-        *iter_x = *iter_y = *iter_z = bad_point;
-      }
-      else
-      {
-        // Fill in XYZ
-        *iter_x = (u - center_x) * depth * constant_x;
-        *iter_y = (v - center_y) * depth * constant_y;
-        *iter_z = DepthTraits<T>::toMeters(depth);
-      }
-
-      // Fill in color
-      *iter_a = 255;
-      *iter_r = rgb[RGB8_RED_OFFSET];
-      *iter_g = rgb[RGB8_GREEN_OFFSET];
-      *iter_b = rgb[RGB8_BLUE_OFFSET];
+        pixels += run.u_end - run.u_begin;
+        longest = std::max(longest, run.u_end - run.u_begin);
+    }
+    cloud->clear();
+    cloud->reserve(pixels);
+
+    // only valid masked pixels become points, so the cloud is unorganized
+    std::vector<float> xyz(3 * longest);
+    for (const PixelRun &run : runs)
+    {
+        const T *depth_row = reinterpret_cast<const T *>(&depth_msg->data[run.v * depth_msg->step]);
+        const uint8_t *rgb = &rgb_msg->data[run.v * rgb_msg->step + run.u_begin * RGB8_COLOR_STEP];
+        deproject_row(rays, depth_row, run.v, run.u_begin, run.u_end, depth_scale, xyz.data());
+        const float *p = xyz.data();
+        for (int u = run.u_begin; u < run.u_end; ++u, rgb += RGB8_COLOR_STEP, p += 3)
+        {
+            if (std::isnan(p[2]))
+                continue;
+
+            PointT pt;
+            pt.x = p[0];
+            pt.y = p[1];
+            pt.z = p[2];
+            pt.a = 255;
+            pt.r = rgb[RGB8_RED_OFFSET];
+            pt.g = rgb[RGB8_GREEN_OFFSET];
+            pt.b = rgb[RGB8_BLUE_OFFSET];
+            pt.label = run.label;
+            cloud->push_back(pt);
+        }
     }
-  }
+    cloud->width = cloud->size();
+    cloud->height = 1;
+    cloud->is_dense = true;
 }
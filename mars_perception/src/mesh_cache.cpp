@@ -0,0 +1,206 @@
+#include <mars_perception/mesh_cache.h>
+#include <mars_perception/mesh_sampling.h>
+#include <pcl/common/io.h>
+#include <pcl/io/pcd_io.h>
+#include <sys/stat.h>
+#include <cerrno>
+#include <cstdio>
+#include <sstream>
+#include <thread>
+
+// part of every cache file name. Bump it whenever the STL reader, the
+// sampler or the stored cloud changes, so files written by an older build
+// are resampled instead of reused. 1 was the VTK sampler's unversioned key.
+static const int SAMPLER_VERSION = 3;
+
+MeshCache::MeshCache(ros::NodeHandle &nh, const std::string &cache_dir, int threads)
+    : nh_(nh), cache_dir_(cache_dir)
+{
+  if (!cache_dir_.empty() && mkdir(cache_dir_.c_str(), 0755) != 0 && errno != EEXIST)
+  {
+    ROS_WARN("Cannot create mesh cache directory %s, keeping meshes in memory only", cache_dir_.c_str());
+    cache_dir_.clear();
+  }
+
+  if (threads <= 0)
+    threads = std::max(1u, std::thread::hardware_concurrency());
+  pool_.reset(new boost::asio::thread_pool(threads));
+}
+
+MeshCache::~MeshCache()
+{
+  // preloads still queued hold a pointer to this cache
+  pool_->join();
+}
+
+MeshModelConstPtr MeshCache::get(const std::string &name)
+{
+  return request_(name, false).get();
+}
+
+void MeshCache::preload(const std::vector<std::string> &names, const LoadedCallback &on_loaded)
+{
+  for (const std::string &name : names)
+    request_(name, true, on_loaded);
+}
+
+std::shared_future<MeshModelConstPtr> MeshCache::request_(const std::string &name, bool async,
+                                                         const LoadedCallback &on_loaded)
+{
+  std::string path;
+  MeshSampling sampling;
+  struct stat st;
+  if (!read_param_(name, path, sampling) || stat(path.c_str(), &st) != 0)
+  {
+    ROS_ERROR("Unknown mesh %s (path '%s')", name.c_str(), path.c_str());
+    std::promise<MeshModelConstPtr> missing;
+    missing.set_value(MeshModelConstPtr());
+    return missing.get_future().share();
+  }
+
+  // the first request for a mesh loads it, concurrent requests wait on the
+  // same future instead of sampling it twice
+  auto promise = std::make_shared<std::promise<MeshModelConstPtr>>();
+  std::shared_future<MeshModelConstPtr> model = promise->get_future().share();
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = entries_.find(name);
+    if (it != entries_.end() && it->second.path == path && it->second.sampling == sampling &&
+        it->second.mtime == st.st_mtime)
+      return it->second.model;
+
+    Entry &entry = entries_[name];
+    entry.path = path;
+    entry.sampling = sampling;
+    entry.mtime = st.st_mtime;
+    entry.model = model;
+  }
+
+  std::time_t mtime = st.st_mtime;
+  auto task = [this, promise, name, path, sampling, mtime, on_loaded]() {
+    MeshModelConstPtr loaded = load_(name, path, sampling, mtime);
+    promise->set_value(loaded);
+    if (loaded && on_loaded)
+      on_loaded(loaded);
+  };
+  if (async)
+    boost::asio::post(*pool_, task);
+  else
+    task();
+  return model;
+}
+
+bool MeshCache::read_param_(const std::string &name, std::string &path, MeshSampling &sampling) const
+{
+  XmlRpc::XmlRpcValue value;
+  if (!nh_.getParam(name, value))
+    return false;
+  if (value.getType() == XmlRpc::XmlRpcValue::TypeString)
+  {
+    path = static_cast<std::string>(value);
+    return true;
+  }
+  if (value.getType() != XmlRpc::XmlRpcValue::TypeStruct || !value.hasMember("path") ||
+      value["path"].getType() != XmlRpc::XmlRpcValue::TypeString)
+    return false;
+
+  path = static_cast<std::string>(value["path"]);
+  if (value.hasMember("points") && value["points"].getType() == XmlRpc::XmlRpcValue::TypeInt)
+    sampling.points = static_cast<int>(value["points"]);
+  if (value.hasMember("spacing"))
+  {
+    XmlRpc::XmlRpcValue &spacing = value["spacing"];
+    if (spacing.getType() == XmlRpc::XmlRpcValue::TypeDouble)
+      sampling.spacing = static_cast<double>(spacing);
+    else if (spacing.getType() == XmlRpc::XmlRpcValue::TypeInt)
+      sampling.spacing = static_cast<int>(spacing);
+  }
+  return true;
+}
+
+MeshModelConstPtr MeshCache::load_(const std::string &name, const std::string &path, const MeshSampling &sampling,
+                                   std::time_t mtime)
+{
+  ros::WallTime start = ros::WallTime::now();
+  pcl::PointCloud<MeshModel::PointNormalT>::Ptr cloud_normals(new pcl::PointCloud<MeshModel::PointNormalT>);
+  std::string file = cache_file_(name, path, sampling, mtime);
+
+  bool from_disk = false;
+  struct stat st;
+  if (!file.empty() && stat(file.c_str(), &st) == 0)
+  {
+    from_disk = pcl::io::loadPCDFile(file, *cloud_normals) == 0 && !cloud_normals->empty();
+  }
+
+  if (!from_disk)
+  {
+    if (!sample_stl(path, *cloud_normals, sampling))
+    {
+      ROS_ERROR("Cannot load mesh %s from %s", name.c_str(), path.c_str());
+      return MeshModelConstPtr();
+    }
+
+    if (!file.empty())
+    {
+      // write then rename so a concurrent reader never sees a partial file
+      std::string tmp = file + ".tmp";
+      if (pcl::io::savePCDFileBinary(tmp, *cloud_normals) != 0 || std::rename(tmp.c_str(), file.c_str()) != 0)
+        ROS_WARN("Cannot write mesh cache file %s", file.c_str());
+    }
+  }
+
+  std::shared_ptr<MeshModel> model(new MeshModel);
+  model->name = name;
+  model->path = path;
+  model->mtime = mtime;
+  pcl::PointCloud<MeshModel::PointT>::Ptr cloud(new pcl::PointCloud<MeshModel::PointT>);
+  pcl::copyPointCloud(*cloud_normals, *cloud);
+  model->cloud = cloud;
+  model->cloud_normals = cloud_normals;
+
+  ROS_INFO("Mesh %s: %zu points %s in %.1f ms", name.c_str(), cloud->size(),
+           from_disk ? "read from cache" : "sampled", (ros::WallTime::now() - start).toSec() * 1000.0);
+  return model;
+}
+
+bool MeshCache::sample_stl(const std::string &path, pcl::PointCloud<MeshModel::PointNormalT> &cloud,
+                           const MeshSampling &sampling)
+{
+  TriangleList triangles;
+  if (!read_stl(path, triangles))
+    return false;
+  pcl::PointCloud<MeshModel::PointNormalT>::Ptr samples(new pcl::PointCloud<MeshModel::PointNormalT>);
+  if (sampling.points > 0)
+    poisson_disk_to_pc(triangles, *samples, 0.0, sampling.points);
+  else if (sampling.spacing > 0.0)
+    poisson_disk_to_pc(triangles, *samples, sampling.spacing * 1000.0, 0);
+  else
+    triangles_to_pc(triangles, *samples);
+  if (samples->empty())
+    return false;
+
+  // STLs are in millimeters, models are in meters around their centroid
+  Eigen::Vector3d centroid = Eigen::Vector3d::Zero();
+  for (const auto &p : samples->points)
+    centroid += p.getVector3fMap().cast<double>();
+  centroid /= samples->size() * 1000.0;
+  for (auto &p : samples->points)
+  {
+    p.getVector3fMap() = p.getVector3fMap() / 1000.0f - centroid.cast<float>();
+    p.getNormalVector3fMap().normalize();
+  }
+  cloud.swap(*samples);
+  return true;
+}
+
+std::string MeshCache::cache_file_(const std::string &name, const std::string &path, const MeshSampling &sampling,
+                                   std::time_t mtime) const
+{
+  if (cache_dir_.empty())
+    return "";
+  std::ostringstream key;
+  key << SAMPLER_VERSION << "|" << path << "|" << sampling.points << "|" << sampling.spacing;
+  std::ostringstream file;
+  file << cache_dir_ << "/" << name << "_" << std::hex << std::hash<std::string>()(key.str()) << "_" << std::dec << mtime << ".pcd";
+  return file.str();
+}
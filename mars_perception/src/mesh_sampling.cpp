@@ -36,194 +36,344 @@
 
  */
 #include <mars_perception/mesh_sampling.h>
+#include <algorithm>
+#include <cmath>
+#include <queue>
+#include <random>
+#include <thread>
+#include <unordered_map>
 
-inline double
-uniform_deviate (int seed)
-{
-  double ran = seed * (1.0 / (RAND_MAX + 1.0));
-  return ran;
-}
+// samples per RNG stream, each chunk seeds its own generator so the cloud
+// only depends on the seed, not on how chunks are spread over threads
+static const std::size_t SAMPLE_CHUNK = 4096;
 
 inline void
-randomPointTriangle (float a1, float a2, float a3, float b1, float b2, float b3, float c1, float c2, float c3,
+randomPointTriangle (const Eigen::Vector3f &a, const Eigen::Vector3f &b, const Eigen::Vector3f &c,
                      float r1, float r2, Eigen::Vector3f& p)
 {
   float r1sqr = std::sqrt (r1);
-  float OneMinR1Sqr = (1 - r1sqr);
-  float OneMinR2 = (1 - r2);
-  a1 *= OneMinR1Sqr;
-  a2 *= OneMinR1Sqr;
-  a3 *= OneMinR1Sqr;
-  b1 *= OneMinR2;
-  b2 *= OneMinR2;
-  b3 *= OneMinR2;
-  c1 = r1sqr * (r2 * c1 + b1) + a1;
-  c2 = r1sqr * (r2 * c2 + b2) + a2;
-  c3 = r1sqr * (r2 * c3 + b3) + a3;
-  p[0] = c1;
-  p[1] = c2;
-  p[2] = c3;
+  p = (1 - r1sqr) * a + r1sqr * ((1 - r2) * b + r2 * c);
 }
 
-inline void
-randPSurface (vtkPolyData * polydata, std::vector<double> * cumulativeAreas, double totalArea, Eigen::Vector3f& p, bool calcNormal, Eigen::Vector3f& n, bool calcColor, Eigen::Vector3f& c)
+void
+triangles_from_polydata (vtkPolyData *polydata, TriangleList &triangles)
 {
-  float r = static_cast<float> (uniform_deviate (rand ()) * totalArea);
-
-  std::vector<double>::iterator low = std::lower_bound (cumulativeAreas->begin (), cumulativeAreas->end (), r);
-  vtkIdType el = vtkIdType (low - cumulativeAreas->begin ());
+  polydata->BuildCells ();
+  vtkSmartPointer<vtkCellArray> cells = polydata->GetPolys ();
 
-  double A[3], B[3], C[3];
+  double p[3];
   vtkIdType npts = 0;
   vtkCellPtsPtr ptIds = nullptr;
+  triangles.resize (cells->GetNumberOfCells ());
+  std::size_t t = 0;
+  for (cells->InitTraversal (); cells->GetNextCell (npts, ptIds); ++t)
+  {
+    for (int k = 0; k < 3; ++k)
+    {
+      polydata->GetPoint (ptIds[k], p);
+      triangles.set_corner (t, k, float (p[0]), float (p[1]), float (p[2]));
+    }
+  }
+  triangles.resize (t);
+}
 
-  polydata->GetCellPoints (el, npts, ptIds);
-  polydata->GetPoint (ptIds[0], A);
-  polydata->GetPoint (ptIds[1], B);
-  polydata->GetPoint (ptIds[2], C);
-  if (calcNormal)
+SurfaceSampler::SurfaceSampler (const TriangleList &triangles) : triangles_ (triangles), area_ (0.0)
+{
+  const std::size_t n = triangles_.size ();
+  std::vector<double> areas (n);
+  normals_.resize (n);
+  for (std::size_t i = 0; i < n; ++i)
   {
-    // OBJ: Vertices are stored in a counter-clockwise order by default
-    Eigen::Vector3f v1 = Eigen::Vector3f (A[0], A[1], A[2]) - Eigen::Vector3f (C[0], C[1], C[2]);
-    Eigen::Vector3f v2 = Eigen::Vector3f (B[0], B[1], B[2]) - Eigen::Vector3f (C[0], C[1], C[2]);
-    n = v1.cross (v2);
-    n.normalize ();
+    const Eigen::Vector3f a = triangles_.corner (i, 0);
+    const Eigen::Vector3f b = triangles_.corner (i, 1);
+    const Eigen::Vector3f c = triangles_.corner (i, 2);
+    // STL and OBJ faces are counter-clockwise seen from outside
+    Eigen::Vector3f cross = (a - c).cross (b - c);
+    areas[i] = 0.5 * cross.norm ();
+    normals_[i] = cross.normalized ();
+    area_ += areas[i];
   }
-  float r1 = static_cast<float> (uniform_deviate (rand ()));
-  float r2 = static_cast<float> (uniform_deviate (rand ()));
-  randomPointTriangle (float (A[0]), float (A[1]), float (A[2]),
-                       float (B[0]), float (B[1]), float (B[2]),
-                       float (C[0]), float (C[1]), float (C[2]), r1, r2, p);
 
-  if (calcColor)
+  // Vose's alias method: every slot keeps its own triangle with prob_ and
+  // hands the rest of its 1/n share to alias_
+  prob_.assign (n, 1.0f);
+  alias_.resize (n);
+  for (std::size_t i = 0; i < n; ++i)
+    alias_[i] = static_cast<std::uint32_t> (i);
+  if (area_ <= 0.0)
+    return;
+  std::vector<double> scaled (n);
+  std::vector<std::uint32_t> small, large;
+  for (std::size_t i = 0; i < n; ++i)
   {
-    vtkUnsignedCharArray *const colors = vtkUnsignedCharArray::SafeDownCast (polydata->GetPointData ()->GetScalars ());
-    if (colors && colors->GetNumberOfComponents () == 3)
-    {
-      double cA[3], cB[3], cC[3];
-      colors->GetTuple (ptIds[0], cA);
-      colors->GetTuple (ptIds[1], cB);
-      colors->GetTuple (ptIds[2], cC);
-
-      randomPointTriangle (float (cA[0]), float (cA[1]), float (cA[2]),
-                           float (cB[0]), float (cB[1]), float (cB[2]),
-                           float (cC[0]), float (cC[1]), float (cC[2]), r1, r2, c);
-    }
-    else
+    scaled[i] = areas[i] * n / area_;
+    (scaled[i] < 1.0 ? small : large).push_back (static_cast<std::uint32_t> (i));
+  }
+  while (!small.empty () && !large.empty ())
+  {
+    std::uint32_t s = small.back (), l = large.back ();
+    small.pop_back ();
+    prob_[s] = static_cast<float> (scaled[s]);
+    alias_[s] = l;
+    scaled[l] -= 1.0 - scaled[s];
+    if (scaled[l] < 1.0)
     {
-      static bool printed_once = false;
-      if (!printed_once)
-        PCL_WARN ("Mesh has no vertex colors, or vertex colors are not RGB!\n");
-      printed_once = true;
+      large.pop_back ();
+      small.push_back (l);
     }
   }
+  // what is left is 1 up to rounding
 }
 
 void
-uniform_sampling (vtkSmartPointer<vtkPolyData> polydata, std::size_t n_samples, bool calc_normal, bool calc_color, pcl::PointCloud<pcl::PointXYZRGBNormal> & cloud_out)
+SurfaceSampler::sample (std::size_t n_samples, std::uint64_t seed, int threads,
+                        pcl::PointCloud<pcl::PointXYZRGBNormal> &cloud_out) const
 {
-  polydata->BuildCells ();
-  vtkSmartPointer<vtkCellArray> cells = polydata->GetPolys ();
-
-  double p1[3], p2[3], p3[3], totalArea = 0;
-  std::vector<double> cumulativeAreas (cells->GetNumberOfCells (), 0);
-  vtkIdType npts = 0;
-  vtkCellPtsPtr ptIds = nullptr;
-  std::size_t cellId = 0;
-  for (cells->InitTraversal (); cells->GetNextCell (npts, ptIds); cellId++)
-  {
-    polydata->GetPoint (ptIds[0], p1);
-    polydata->GetPoint (ptIds[1], p2);
-    polydata->GetPoint (ptIds[2], p3);
-    totalArea += vtkTriangle::TriangleArea (p1, p2, p3);
-    cumulativeAreas[cellId] = totalArea;
-  }
-
+  cloud_out.clear ();
+  if (triangles_.size () == 0 || area_ <= 0.0)
+    return;
   cloud_out.resize (n_samples);
   cloud_out.width = static_cast<std::uint32_t> (n_samples);
   cloud_out.height = 1;
 
-  for (std::size_t i = 0; i < n_samples; i++)
-  {
-    Eigen::Vector3f p;
-    Eigen::Vector3f n (0, 0, 0);
-    Eigen::Vector3f c (0, 0, 0);
-    randPSurface (polydata, &cumulativeAreas, totalArea, p, calc_normal, n, calc_color, c);
-    cloud_out[i].x = p[0];
-    cloud_out[i].y = p[1];
-    cloud_out[i].z = p[2];
-    if (calc_normal)
-    {
-      cloud_out[i].normal_x = n[0];
-      cloud_out[i].normal_y = n[1];
-      cloud_out[i].normal_z = n[2];
-    }
-    if (calc_color)
+  const std::size_t chunks = (n_samples + SAMPLE_CHUNK - 1) / SAMPLE_CHUNK;
+  auto sample_chunk = [&](std::size_t chunk) {
+    std::seed_seq seeds {std::uint32_t (seed), std::uint32_t (seed >> 32), std::uint32_t (chunk)};
+    std::mt19937 rng (seeds);
+    std::uniform_real_distribution<float> unit (0.0f, 1.0f);
+    const std::size_t n = triangles_.size ();
+    // column and coin from separate draws, the fraction of one float
+    // times n keeps only a few bits on meshes of 100k triangles
+    std::uniform_int_distribution<std::size_t> column (0, n - 1);
+    const std::size_t end = std::min (n_samples, (chunk + 1) * SAMPLE_CHUNK);
+    for (std::size_t i = chunk * SAMPLE_CHUNK; i < end; ++i)
     {
-      cloud_out[i].r = static_cast<std::uint8_t>(c[0]);
-      cloud_out[i].g = static_cast<std::uint8_t>(c[1]);
-      cloud_out[i].b = static_cast<std::uint8_t>(c[2]);
+      std::size_t slot = column (rng);
+      std::size_t t = unit (rng) < prob_[slot] ? slot : alias_[slot];
+
+      Eigen::Vector3f p;
+      randomPointTriangle (triangles_.corner (t, 0), triangles_.corner (t, 1), triangles_.corner (t, 2),
+                           unit (rng), unit (rng), p);
+      pcl::PointXYZRGBNormal &out = cloud_out[i];
+      out.getVector3fMap () = p;
+      out.getNormalVector3fMap () = normals_[t];
+      out.rgba = 0;
     }
+  };
+
+  if (threads <= 0)
+    threads = std::max (1u, std::thread::hardware_concurrency ());
+  threads = static_cast<int> (std::min<std::size_t> (threads, chunks));
+  if (threads <= 1)
+  {
+    for (std::size_t chunk = 0; chunk < chunks; ++chunk)
+      sample_chunk (chunk);
+    return;
+  }
+  std::vector<std::thread> workers;
+  for (int w = 0; w < threads; ++w)
+  {
+    workers.emplace_back ([&, w]() {
+      for (std::size_t chunk = w; chunk < chunks; chunk += threads)
+        sample_chunk (chunk);
+    });
   }
+  for (auto &worker : workers)
+    worker.join ();
 }
 
 using namespace pcl;
 using namespace pcl::io;
 using namespace pcl::console;
 
-const int default_number_samples = 100000;
 const float default_leaf_size = 1.0f;
-const bool write_normals = true;
-const bool write_colors = false;
 
-/* ---[ */
-void polygon_mesh_to_pc(pcl::PolygonMesh* mesh_ptr, pcl::PointCloud<pcl::PointXYZRGB>::Ptr pc_ptr) {
+void triangles_to_pc(const TriangleList &triangles, pcl::PointCloud<pcl::PointXYZRGBNormal> &pc,
+                     std::size_t n_samples, std::uint64_t seed, int threads) {
+  pcl::PointCloud<pcl::PointXYZRGBNormal>::Ptr cloud_1 (new pcl::PointCloud<pcl::PointXYZRGBNormal>);
+  SurfaceSampler (triangles).sample (n_samples, seed, threads, *cloud_1);
 
-  // Parse command line arguments
-  int SAMPLE_POINTS_ = default_number_samples;
-  float leaf_size = default_leaf_size;
+  // Voxelgrid, normals are averaged per voxel along with the points
+  VoxelGrid<PointXYZRGBNormal> grid_;
+  grid_.setInputCloud (cloud_1);
+  grid_.setLeafSize (default_leaf_size, default_leaf_size, default_leaf_size);
+  grid_.filter (pc);
+}
 
-  vtkSmartPointer<vtkPolyData> polydata1 = vtkSmartPointer<vtkPolyData>::New ();
-  pcl::io::mesh2vtk (*mesh_ptr, polydata1);
+// Points bucketed by cubic cells of the query radius, so a fixed radius
+// query only visits the 27 cells around the point
+class RadiusGrid
+{
+public:
+  explicit RadiusGrid (float radius) : inv_cell_ (1.0f / radius) {}
 
-  //make sure that the polygons are triangles!
-  vtkSmartPointer<vtkTriangleFilter> triangleFilter = vtkSmartPointer<vtkTriangleFilter>::New ();
-  triangleFilter->SetInputData (polydata1);
-  triangleFilter->Update ();
+  void insert (const Eigen::Vector3f &p, std::uint32_t index) { cells_[key_ (cell_of_ (p))].push_back (index); }
 
-  vtkSmartPointer<vtkPolyDataMapper> triangleMapper = vtkSmartPointer<vtkPolyDataMapper>::New ();
-  triangleMapper->SetInputConnection (triangleFilter->GetOutputPort ());
-  triangleMapper->Update ();
-  polydata1 = triangleMapper->GetInput ();
+  template <typename F> void
+  for_each_near (const Eigen::Vector3f &p, F f) const
+  {
+    const Eigen::Vector3i center = cell_of_ (p);
+    for (int dx = -1; dx <= 1; ++dx)
+      for (int dy = -1; dy <= 1; ++dy)
+        for (int dz = -1; dz <= 1; ++dz)
+        {
+          auto it = cells_.find (key_ (center + Eigen::Vector3i (dx, dy, dz)));
+          if (it == cells_.end ())
+            continue;
+          for (std::uint32_t index : it->second)
+            if (!f (index))
+              return;
+        }
+  }
 
-  pcl::PointCloud<pcl::PointXYZRGBNormal>::Ptr cloud_1 (new pcl::PointCloud<pcl::PointXYZRGBNormal>);
-  uniform_sampling (polydata1, SAMPLE_POINTS_, write_normals, write_colors, *cloud_1);
+private:
+  float inv_cell_;
+  std::unordered_map<std::uint64_t, std::vector<std::uint32_t>> cells_;
 
-  // Voxelgrid
-  VoxelGrid<PointXYZRGBNormal> grid_;
-  grid_.setInputCloud (cloud_1);
-  grid_.setLeafSize (leaf_size, leaf_size, leaf_size);
-  pcl::PointCloud<pcl::PointXYZRGBNormal>::Ptr voxel_cloud (new pcl::PointCloud<pcl::PointXYZRGBNormal>);
-  grid_.filter (*voxel_cloud);
+  Eigen::Vector3i
+  cell_of_ (const Eigen::Vector3f &p) const
+  {
+    return (p * inv_cell_).array ().floor ().cast<int> ();
+  }
+
+  static std::uint64_t
+  key_ (const Eigen::Vector3i &c)
+  {
+    const int offset = 1 << 20;
+    return (std::uint64_t ((c.x () + offset) & 0x1FFFFF) << 42) | (std::uint64_t ((c.y () + offset) & 0x1FFFFF) << 21) |
+           std::uint64_t ((c.z () + offset) & 0x1FFFFF);
+  }
+};
+
+// Yuksel, "Sample Elimination for Generating Poisson Disk Sample Sets":
+// every candidate is weighted by how crowded its neighbourhood is and the
+// most crowded one is removed until n_points are left
+static void
+eliminate_samples (const pcl::PointCloud<pcl::PointXYZRGBNormal> &candidates, double area, std::size_t n_points,
+                   pcl::PointCloud<pcl::PointXYZRGBNormal> &pc)
+{
+  const std::size_t m = candidates.size ();
+  // the largest spacing n_points can have, hexagonal packing
+  const float r_max = static_cast<float> (std::sqrt (area / (2.0 * std::sqrt (3.0) * n_points)));
+  const float d_max = 2.0f * r_max;
+  // closer pairs than d_min all weigh the same, keeps clusters of the
+  // random candidates from dominating
+  const float d_min = d_max * (1.0f - std::pow (float (n_points) / m, 1.5f)) * 0.65f;
+
+  RadiusGrid grid (d_max);
+  for (std::size_t i = 0; i < m; ++i)
+    grid.insert (candidates[i].getVector3fMap (), static_cast<std::uint32_t> (i));
+
+  std::vector<std::vector<std::pair<std::uint32_t, float>>> neighbours (m);
+  std::vector<float> weight (m, 0.0f);
+  for (std::size_t i = 0; i < m; ++i)
+  {
+    const Eigen::Vector3f p = candidates[i].getVector3fMap ();
+    grid.for_each_near (p, [&](std::uint32_t j) {
+      float d = (candidates[j].getVector3fMap () - p).norm ();
+      if (j != i && d < d_max)
+      {
+        float w = std::pow (1.0f - std::max (d, d_min) / d_max, 8.0f);
+        neighbours[i].emplace_back (j, w);
+        weight[i] += w;
+      }
+      return true;
+    });
+  }
+
+  // stale entries are skipped when popped instead of updated in place
+  std::priority_queue<std::pair<float, std::uint32_t>> heap;
+  for (std::size_t i = 0; i < m; ++i)
+    heap.emplace (weight[i], static_cast<std::uint32_t> (i));
+  std::vector<bool> removed (m, false);
+  std::size_t left = m;
+  while (left > n_points && !heap.empty ())
+  {
+    std::pair<float, std::uint32_t> top = heap.top ();
+    heap.pop ();
+    if (removed[top.second] || top.first != weight[top.second])
+      continue;
+    removed[top.second] = true;
+    --left;
+    for (const auto &n : neighbours[top.second])
+    {
+      if (removed[n.first])
+        continue;
+      weight[n.first] -= n.second;
+      heap.emplace (weight[n.first], n.first);
+    }
+  }
 
+  pc.clear ();
+  pc.reserve (left);
+  for (std::size_t i = 0; i < m; ++i)
+    if (!removed[i])
+      pc.push_back (candidates[i]);
+}
 
-  // Strip uninitialized normals and colors from cloud:
-  pcl::copyPointCloud (*voxel_cloud, *pc_ptr);
+// keeps the candidates in order unless one already kept is closer than
+// spacing
+static void
+throw_darts (const pcl::PointCloud<pcl::PointXYZRGBNormal> &candidates, float spacing,
+             pcl::PointCloud<pcl::PointXYZRGBNormal> &pc)
+{
+  const float sqr_spacing = spacing * spacing;
+  RadiusGrid grid (spacing);
+  pc.clear ();
+  for (const auto &candidate : candidates)
+  {
+    const Eigen::Vector3f p = candidate.getVector3fMap ();
+    bool free = true;
+    grid.for_each_near (p, [&](std::uint32_t j) {
+      free = (pc[j].getVector3fMap () - p).squaredNorm () >= sqr_spacing;
+      return free;
+    });
+    if (!free)
+      continue;
+    grid.insert (p, static_cast<std::uint32_t> (pc.size ()));
+    pc.push_back (candidate);
+  }
+}
 
-  // center pointcloud
-  double av_x,av_y,av_z = 0;
-  for(int i = 0; i < pc_ptr->size(); i++) {
-    av_x += (*pc_ptr)[i].x;
-    av_y += (*pc_ptr)[i].y;
-    av_z += (*pc_ptr)[i].z;
+void poisson_disk_to_pc(const TriangleList &triangles, pcl::PointCloud<pcl::PointXYZRGBNormal> &pc, double spacing,
+                        std::size_t n_points, std::uint64_t seed, int threads) {
+  SurfaceSampler sampler (triangles);
+  pcl::PointCloud<pcl::PointXYZRGBNormal> candidates;
+  if (n_points > 0)
+  {
+    sampler.sample (5 * n_points, seed, threads, candidates);
+    eliminate_samples (candidates, sampler.area (), n_points, pc);
   }
-  av_x /= pc_ptr->size();
-  av_y /= pc_ptr->size();
-  av_z /= pc_ptr->size();
-
-  for(int i = 0; i < pc_ptr->size(); i++) {
-    (*pc_ptr)[i].x -= av_x;
-    (*pc_ptr)[i].y -= av_y;
-    (*pc_ptr)[i].z -= av_z;
+  else if (spacing > 0.0)
+  {
+    // a disk of spacing / 2 around every point, ten darts per disk area
+    // leave few gaps, capped for tiny spacings on large meshes
+    const double darts = 10.0 * sampler.area () / (M_PI * 0.25 * spacing * spacing);
+    sampler.sample (static_cast<std::size_t> (std::min (darts, 4e6)), seed, threads, candidates);
+    throw_darts (candidates, static_cast<float> (spacing), pc);
+  }
+  else
+  {
+    pc.clear ();
   }
-}
\ No newline at end of file
+  pc.width = static_cast<std::uint32_t> (pc.size ());
+  pc.height = 1;
+  pc.is_dense = true;
+}
+
+/* ---[ */
+void polygon_mesh_to_pc(pcl::PolygonMesh* mesh_ptr, pcl::PointCloud<pcl::PointXYZRGBNormal>::Ptr pc_ptr,
+                        std::size_t n_samples, std::uint64_t seed, int threads) {
+
+  vtkSmartPointer<vtkPolyData> polydata1 = vtkSmartPointer<vtkPolyData>::New ();
+  pcl::io::mesh2vtk (*mesh_ptr, polydata1);
+
+  //make sure that the polygons are triangles!
+  vtkSmartPointer<vtkTriangleFilter> triangleFilter = vtkSmartPointer<vtkTriangleFilter>::New ();
+  triangleFilter->SetInputData (polydata1);
+  triangleFilter->Update ();
+
+  TriangleList triangles;
+  triangles_from_polydata (triangleFilter->GetOutput (), triangles);
+  triangles_to_pc (triangles, *pc_ptr, n_samples, seed, threads);
+}
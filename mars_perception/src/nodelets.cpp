@@ -0,0 +1,47 @@
+#include <nodelet/nodelet.h>
+#include <pluginlib/class_list_macros.h>
+#include <mars_perception/registration.h>
+#include <mars_perception/icp.h>
+#include <mars_perception/mask_depth.h>
+
+// Nodelet wrappers so the perception stages can share a manager with the
+// realsense nodelets and pass clouds as pointers instead of over TCPROS.
+// Each stage keeps a single threaded callback queue like the standalone nodes.
+namespace mars_perception
+{
+
+  class PCRegistrationNodelet : public nodelet::Nodelet
+  {
+    std::unique_ptr<PCRegistration> registration_;
+
+    void onInit() override
+    {
+      registration_.reset(new PCRegistration(getNodeHandle(), getPrivateNodeHandle()));
+    }
+  };
+
+  class ICPNodelet : public nodelet::Nodelet
+  {
+    std::unique_ptr<ICP> icp_;
+
+    void onInit() override
+    {
+      icp_.reset(new ICP(getNodeHandle(), getPrivateNodeHandle()));
+    }
+  };
+
+  class MaskDepthNodelet : public nodelet::Nodelet
+  {
+    std::unique_ptr<MaskDepth> mask_depth_;
+
+    void onInit() override
+    {
+      mask_depth_.reset(new MaskDepth(getNodeHandle(), getPrivateNodeHandle()));
+    }
+  };
+
+}
+
+PLUGINLIB_EXPORT_CLASS(mars_perception::PCRegistrationNodelet, nodelet::Nodelet)
+PLUGINLIB_EXPORT_CLASS(mars_perception::ICPNodelet, nodelet::Nodelet)
+PLUGINLIB_EXPORT_CLASS(mars_perception::MaskDepthNodelet, nodelet::Nodelet)
@@ -0,0 +1,68 @@
+#include <mars_perception/ray_table.h>
+#include <cmath>
+#include <limits>
+
+bool RayTable::update(const image_geometry::PinholeCameraModel &model)
+{
+  const cv::Size size = model.fullResolution();
+  return update(size.width, size.height, model.fx(), model.fy(), model.cx(), model.cy());
+}
+
+bool RayTable::update(int width, int height, double fx, double fy, double cx, double cy)
+{
+  if (width == width_ && height == height_ && fx == fx_ && fy == fy_ && cx == cx_ && cy == cy_)
+    return false;
+  width_ = width;
+  height_ = height;
+  fx_ = fx;
+  fy_ = fy;
+  cx_ = cx;
+  cy_ = cy;
+  x_.resize(width);
+  y_.resize(height);
+  for (int u = 0; u < width; ++u)
+    x_[u] = static_cast<float>((u - cx) / fx);
+  for (int v = 0; v < height; ++v)
+    y_[v] = static_cast<float>((v - cy) / fy);
+  return true;
+}
+
+void deproject_row(const RayTable &rays, const uint16_t *depth, int v, int u_begin, int u_end, float depth_scale,
+                   float *xyz)
+{
+  const float *__restrict ray_x = rays.x() + u_begin;
+  const uint16_t *__restrict d = depth + u_begin;
+  float *__restrict out = xyz;
+  const float ray_y = rays.y(v);
+  const float nan = std::numeric_limits<float>::quiet_NaN();
+  const int n = u_end - u_begin;
+  // branch free and the zero test on the float, so with -fopenmp or
+  // -fopenmp-simd this becomes conversions, blends and interleaving stores
+  // even at -O2
+#pragma omp simd
+  for (int i = 0; i < n; ++i)
+  {
+    float z = d[i] * depth_scale;
+    z = z > 0.0f ? z : nan;
+    out[3 * i] = ray_x[i] * z;
+    out[3 * i + 1] = ray_y * z;
+    out[3 * i + 2] = z;
+  }
+}
+
+void deproject_row(const RayTable &rays, const float *depth, int v, int u_begin, int u_end, float depth_scale,
+                   float *xyz)
+{
+  const float *ray_x = rays.x();
+  const float ray_y = rays.y(v);
+  const float nan = std::numeric_limits<float>::quiet_NaN();
+  for (int u = u_begin; u < u_end; ++u, xyz += 3)
+  {
+    float z = depth[u] * depth_scale;
+    if (!std::isfinite(z) || z == 0.0f)
+      z = nan;
+    xyz[0] = ray_x[u] * z;
+    xyz[1] = ray_y * z;
+    xyz[2] = z;
+  }
+}
@@ -1,89 +1,197 @@
 #include <mars_perception/registration.h>
 
-PCRegistration::PCRegistration() : nh_(), tf_listener_(), cloud_concatenated(new PointCloudT)
+PCRegistration::PCRegistration(ros::NodeHandle &nh, ros::NodeHandle &pnh)
+    : nh_(nh), pnh_(pnh), tf_listener_(), cloud_concatenated(new PointCloudT), hash_cell_(0.0), worker_threads_(1)
 {
   std::vector<std::string> point_cloud_topics;
   std::string output_topic;
+  double extrinsics_timeout = 0.0;
+  double sync_max_interval = 0.1;
 
   ros::param::get("/base_frame", base_frame_id_);
 
   // global
-  ros::param::get("~filtered_points_topic", output_topic);
-  ros::param::get("~point_cloud_topics", point_cloud_topics);
+  pnh_.getParam("filtered_points_topic", output_topic);
+  pnh_.getParam("point_cloud_topics", point_cloud_topics);
+  pnh_.getParam("worker_threads", worker_threads_);
+  pnh_.getParam("extrinsics_timeout", extrinsics_timeout);
+  pnh_.getParam("sync_max_interval", sync_max_interval);
 
   // box filter params
-  ros::param::get("~box_enabled", box_enabled_);
-  ros::param::get("~box_min", box_min_);
-  ros::param::get("~box_max", box_max_);
+  pnh_.getParam("box_enabled", box_enabled_);
+  pnh_.getParam("box_min", box_min_);
+  pnh_.getParam("box_max", box_max_);
 
   // voxel filter params
-  ros::param::get("~voxel_enabled", voxel_enabled_);
-  ros::param::get("~leaf_sizes", leaf_sizes_);
+  pnh_.getParam("voxel_enabled", voxel_enabled_);
+  pnh_.getParam("leaf_sizes", leaf_sizes_);
+
+  // filter backend
+  filter_mode_ = "pcl";
+  pnh_.getParam("filter_mode", filter_mode_);
 
   // ICP params
-  ros::param::get("~icp_enabled", icp_enabled_);
-  ros::param::get("~max_correspondence_distance", max_corresp_dist_);
-  ros::param::get("~transformation_epsilon", transf_epsilon_);
-  ros::param::get("~fitness_epsilon", fitness_epsilon_);
-  ros::param::get("~max_iterations", max_iter_);
-  ros::param::get("~ransac_rejection_threshold", reject_thres_);
-
-  if (point_cloud_topics.size() != CAM_CNT)
+  pnh_.getParam("icp_enabled", icp_enabled_);
+  pnh_.getParam("max_correspondence_distance", max_corresp_dist_);
+  pnh_.getParam("transformation_epsilon", transf_epsilon_);
+  pnh_.getParam("fitness_epsilon", fitness_epsilon_);
+  pnh_.getParam("max_iterations", max_iter_);
+  pnh_.getParam("ransac_rejection_threshold", reject_thres_);
+  pnh_.getParam("voxel_hash_cell", hash_cell_);
+
+  cam_cnt_ = point_cloud_topics.size();
+  if (cam_cnt_ == 0 || leaf_sizes_.getType() != XmlRpc::XmlRpcValue::TypeArray || size_t(leaf_sizes_.size()) < cam_cnt_)
   {
-    ROS_ERROR("The size of camera_topics must be between 2");
-    ros::shutdown();
+    ROS_ERROR("point_cloud_topics must be non-empty with one leaf_sizes entry per topic");
+    return;
   }
 
-  for (size_t i = 0; i < CAM_CNT; ++i)
+  if (filter_mode_ == "fused")
   {
-    cloud_subscribers_[i] =
-        new message_filters::Subscriber<PointCloudMsgT>(nh_, point_cloud_topics[i], 10);
+    for (size_t i = 0; i < cam_cnt_; ++i)
+    {
+      fused_filters_.emplace_back(
+          Eigen::Vector3f(box_min_[0], box_min_[1], box_min_[2]),
+          Eigen::Vector3f(box_max_[0], box_max_[1], box_max_[2]),
+          Eigen::Vector3f((double)leaf_sizes_[i][0], (double)leaf_sizes_[i][1], (double)leaf_sizes_[i][2]));
+    }
   }
+  else if (filter_mode_ != "pcl")
+  {
+    ROS_WARN("Unknown filter_mode %s, using pcl", filter_mode_.c_str());
+    filter_mode_ = "pcl";
+  }
+
+  extrinsics_.reset(new ExtrinsicsCache(nh_, tf_listener_, base_frame_id_, extrinsics_timeout));
 
-  cloud_synchronizer_ = new message_filters::Synchronizer<SyncPolicyT>(
-      SyncPolicyT(10), *cloud_subscribers_[0], *cloud_subscribers_[1], *cloud_subscribers_[2]);
+  if (worker_threads_ <= 0)
+    worker_threads_ = cam_cnt_;
+  if (worker_threads_ > 1)
+  {
+    worker_pool_.reset(new boost::asio::thread_pool(worker_threads_));
+  }
 
-  cloud_synchronizer_->registerCallback(
-      boost::bind(&PCRegistration::pointcloud_callback, this, _1, _2, _3));
   cloud_publisher_ = nh_.advertise<PointCloudMsgT>(output_topic, 1);
+  cloud_synchronizer_.reset(new MultiSynchronizer<PointCloudMsgT>(
+      nh_, point_cloud_topics, 10, ros::Duration(sync_max_interval),
+      boost::bind(&PCRegistration::pointcloud_callback, this, _1)));
 }
 
-void PCRegistration::pointcloud_callback(const PointCloudMsgT::ConstPtr &msg1, const PointCloudMsgT::ConstPtr &msg2, const PointCloudMsgT::ConstPtr &msg3)
+void PCRegistration::preprocess_cloud(const PointCloudMsgT::ConstPtr &msg, size_t i, PointCloudT::Ptr &cloud)
 {
+  cloud = PointCloudT().makeShared();
 
-  PointCloudMsgT::ConstPtr msgs[CAM_CNT] = {msg1, msg2, msg3};
-  PointCloudT::Ptr cloud_sources[CAM_CNT];
+  if (!fused_filters_.empty())
+  {
+    // filter straight out of the message buffer, no intermediate cloud
+    PointCloud2View view(*msg);
+    if (view.valid())
+    {
+      fused_filters_[i].filter(view, extrinsics_->lookup(msg->header.frame_id), *cloud);
+      cloud->header = pcl_conversions::toPCL(msg->header);
+      cloud->header.frame_id = base_frame_id_;
+      return;
+    }
+  }
 
-  cloud_concatenated = PointCloudT::Ptr(new PointCloudT);
+  pcl::fromROSMsg(*msg, *cloud);
+
+  if (!fused_filters_.empty())
+  {
+    PointCloudT::Ptr filtered(new PointCloudT);
+    fused_filters_[i].filter(*cloud, extrinsics_->lookup(msg->header.frame_id), *filtered);
+    filtered->header.frame_id = base_frame_id_;
+    cloud = filtered;
+    return;
+  }
+
+  pcl::transformPointCloud(*cloud, *cloud, extrinsics_->lookup(msg->header.frame_id));
+  cloud->header.frame_id = base_frame_id_;
+
+  if (cloud->size() != 0)
+  {
+      pcl::CropBox<PointT> box_filter;
+      box_filter.setInputCloud(cloud);
+      box_filter.setMin(Eigen::Vector4f(box_min_[0], box_min_[1], box_min_[2], 1.0));
+      box_filter.setMax(Eigen::Vector4f(box_max_[0], box_max_[1], box_max_[2], 1.0));
+      box_filter.filter(*cloud);
+
+      // pcl::MedianFilter<PointT> median_filter;
+      // median_filter.setInputCloud(cloud);
+      // median_filter.filter(*cloud);
+
+      pcl::VoxelGrid<PointT> voxel_filter;
+      voxel_filter.setInputCloud(cloud);
+      voxel_filter.setLeafSize((double)leaf_sizes_[i][0], (double)leaf_sizes_[i][1], (double)leaf_sizes_[i][2]);
+      voxel_filter.filter(*cloud);
+  }
+}
+
+void PCRegistration::for_each_camera(const std::function<void(size_t)> &stage)
+{
+  if (!worker_pool_)
+  {
+    for (size_t i = 0; i < cam_cnt_; ++i)
+      stage(i);
+    return;
+  }
 
-  // transform points
+  std::vector<std::future<void>> pending;
+  for (size_t i = 0; i < cam_cnt_; ++i)
+  {
+    auto task = std::make_shared<std::packaged_task<void()>>(std::bind(stage, i));
+    pending.push_back(task->get_future());
+    boost::asio::post(*worker_pool_, [task]() { (*task)(); });
+  }
+  // wait for every camera before rethrowing so no worker outlives the caller's buffers
+  for (auto &p : pending)
+    p.wait();
+  for (auto &p : pending)
+    p.get();
+}
+
+void PCRegistration::align_cloud(const PointCloudT::Ptr &target, const VoxelHash::ConstPtr &target_hash,
+                                 const pcl::search::KdTree<PointT>::Ptr &target_tree, const PointCloudT::Ptr &cloud)
+{
   try
   {
-    for (size_t i = 0; i < CAM_CNT; ++i)
+    pcl::IterativeClosestPoint<PointT, PointT> icp;
+    icp.setInputSource(cloud);
+    icp.setInputTarget(target);
+    if (target_hash)
+    {
+      icp.setCorrespondenceEstimation(pcl::IterativeClosestPoint<PointT, PointT>::CorrespondenceEstimationPtr(
+          new VoxelHashCorrespondence<PointT, PointT>(target_hash)));
+      icp.setSearchMethodTarget(pcl::search::KdTree<PointT>::Ptr(new pcl::search::KdTree<PointT>), true);
+    }
+    else
     {
-      cloud_sources[i] = PointCloudT().makeShared();
-      pcl::fromROSMsg(*msgs[i], *cloud_sources[i]);
-      tf_listener_.waitForTransform(base_frame_id_, msgs[i]->header.frame_id, ros::Time(0), ros::Duration(1.0));
-      pcl_ros::transformPointCloud(base_frame_id_, ros::Time(0), *cloud_sources[i], msgs[i]->header.frame_id, *cloud_sources[i], tf_listener_);
-
-      if (cloud_sources[i]->size() != 0)
-      {
-          pcl::CropBox<PointT> box_filter;
-          box_filter.setInputCloud(cloud_sources[i]);
-          box_filter.setMin(Eigen::Vector4f(box_min_[0], box_min_[1], box_min_[2], 1.0));
-          box_filter.setMax(Eigen::Vector4f(box_max_[0], box_max_[1], box_max_[2], 1.0));
-          box_filter.filter(*cloud_sources[i]);
-
-          // pcl::MedianFilter<PointT> median_filter;
-          // median_filter.setInputCloud(cloud_sources[i]);
-          // median_filter.filter(*cloud_sources[i]);
-
-          pcl::VoxelGrid<PointT> voxel_filter;
-          voxel_filter.setInputCloud(cloud_sources[i]);
-          voxel_filter.setLeafSize((double)leaf_sizes_[i][0], (double)leaf_sizes_[i][1], (double)leaf_sizes_[i][2]);
-          voxel_filter.filter(*cloud_sources[i]);
-      }
+      icp.setSearchMethodTarget(target_tree, true);
     }
+    icp.setMaxCorrespondenceDistance(max_corresp_dist_);
+    icp.setMaximumIterations(max_iter_);
+    icp.setTransformationEpsilon(transf_epsilon_);
+    icp.setRANSACOutlierRejectionThreshold(reject_thres_);
+    icp.setEuclideanFitnessEpsilon(fitness_epsilon_);
+    icp.align(*cloud);
+  }
+  catch(const std::exception& e)
+  {
+    std::cerr << e.what() << '\n';
+  }
+}
+
+void PCRegistration::pointcloud_callback(const std::vector<PointCloudMsgT::ConstPtr> &msgs)
+{
+  std::vector<PointCloudT::Ptr> cloud_sources(cam_cnt_);
+
+  cloud_concatenated = PointCloudT::Ptr(new PointCloudT);
+
+  // transform points, each camera writes only its own slot so the merge
+  // below sees the same clouds in the same order as the serial path
+  try
+  {
+    for_each_camera([&](size_t i) { preprocess_cloud(msgs[i], i, cloud_sources[i]); });
   }
   catch (tf::TransformException &ex)
   {
@@ -91,36 +199,44 @@ void PCRegistration::pointcloud_callback(const PointCloudMsgT::ConstPtr &msg1, c
     return;
   }
 
+  // align every camera to the first one, each alignment only reads cloud 0
+  // and shares one search structure built over it
+  if (icp_enabled_ && cloud_sources[0]->size() != 0)
+  {
+    VoxelHash::ConstPtr target_hash;
+    pcl::search::KdTree<PointT>::Ptr target_tree;
+    if (hash_cell_ > 0.0)
+    {
+      target_hash = std::make_shared<VoxelHash>(*cloud_sources[0], hash_cell_);
+    }
+    else
+    {
+      target_tree.reset(new pcl::search::KdTree<PointT>);
+      target_tree->setInputCloud(cloud_sources[0]);
+    }
+    for_each_camera([&](size_t i) {
+      if (i != 0 && cloud_sources[i]->size() != 0)
+        align_cloud(cloud_sources[0], target_hash, target_tree, cloud_sources[i]);
+    });
+  }
+
   // merge points
-  for (size_t i = 0; i < CAM_CNT; ++i)
+  size_t total = 0;
+  for (size_t i = 0; i < cam_cnt_; ++i)
+    total += cloud_sources[i]->size();
+  cloud_concatenated->reserve(total);
+  for (size_t i = 0; i < cam_cnt_; ++i)
   {
     if (cloud_sources[i]->size() != 0)
     {
-      if (icp_enabled_ && i != 0)
-      {
-        try
-        {
-          pcl::IterativeClosestPoint<PointT, PointT> icp;
-          icp.setInputSource(cloud_sources[i]);
-          icp.setInputTarget(cloud_sources[0]);
-          icp.setMaxCorrespondenceDistance(max_corresp_dist_);
-          icp.setMaximumIterations(max_iter_);
-          icp.setTransformationEpsilon(transf_epsilon_);
-          icp.setRANSACOutlierRejectionThreshold(reject_thres_);
-          icp.setEuclideanFitnessEpsilon(fitness_epsilon_);
-          icp.align(*cloud_sources[i]);
-        }
-        catch(const std::exception& e)
-        {
-          std::cerr << e.what() << '\n';
-        }
-      }
       *cloud_concatenated += *cloud_sources[i];
     }
   }
 
-  // Publish
+  // Publish, as a message pointer so nodelets in the same manager get it without serialization
   cloud_concatenated->header = pcl_conversions::toPCL(msgs[0]->header);
   cloud_concatenated->header.frame_id = base_frame_id_;
-  cloud_publisher_.publish(cloud_concatenated);
-}
\ No newline at end of file
+  PointCloudMsgT::Ptr output(new PointCloudMsgT);
+  pcl::toROSMsg(*cloud_concatenated, *output);
+  cloud_publisher_.publish(output);
+}
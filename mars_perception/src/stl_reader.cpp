@@ -0,0 +1,141 @@
+#include <mars_perception/stl_reader.h>
+#include <ros/console.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+
+static const std::size_t HEADER_SIZE = 80;
+static const std::size_t FACET_SIZE = 50;
+
+// 12 little endian floats (normal, 3 corners) and a 2 byte attribute
+static void parse_binary(const char *data, std::uint32_t count, TriangleList &triangles)
+{
+  triangles.resize(count);
+  const char *facet = data + HEADER_SIZE + 4;
+  for (std::uint32_t t = 0; t < count; ++t, facet += FACET_SIZE)
+  {
+    float v[12];
+    std::memcpy(v, facet, sizeof(v));
+    for (int k = 0; k < 3; ++k)
+      triangles.set_corner(t, k, v[3 + 3 * k], v[4 + 3 * k], v[5 + 3 * k]);
+  }
+}
+
+// "facet normal .. outer loop vertex x y z (x3) endloop endfacet", only
+// the vertex lines matter
+static bool parse_ascii(const char *begin, const char *end, TriangleList &triangles)
+{
+  std::string text(begin, end);
+  std::vector<float> corners;
+  const char *p = text.c_str();
+  while ((p = std::strstr(p, "vertex")) != nullptr)
+  {
+    p += 6;
+    char *next;
+    for (int i = 0; i < 3; ++i)
+    {
+      corners.push_back(std::strtof(p, &next));
+      if (next == p)
+        return false;
+      p = next;
+    }
+  }
+  if (corners.empty() || corners.size() % 9 != 0)
+    return false;
+
+  std::size_t count = corners.size() / 9;
+  triangles.resize(count);
+  for (std::size_t t = 0; t < count; ++t)
+  {
+    const float *v = &corners[9 * t];
+    for (int k = 0; k < 3; ++k)
+      triangles.set_corner(t, k, v[3 * k], v[3 * k + 1], v[3 * k + 2]);
+  }
+  return true;
+}
+
+// printable text or whitespace only, which a facet of binary floats
+// practically never is
+static bool is_text(const char *begin, const char *end)
+{
+  for (const char *c = begin; c < end; ++c)
+  {
+    unsigned char b = static_cast<unsigned char>(*c);
+    if ((b < 0x20 || b > 0x7E) && b != '\n' && b != '\r' && b != '\t')
+      return false;
+  }
+  return true;
+}
+
+static bool parse_stl(const std::string &path, const char *data, std::size_t size, TriangleList &triangles)
+{
+  // a binary file holds at least the facets its count promises, some
+  // exporters append a few bytes. ASCII files start with "solid" but so do
+  // many binary headers (SolidWorks among others), for those the first
+  // facet must not read as text.
+  if (size >= HEADER_SIZE + 4)
+  {
+    std::uint32_t count;
+    std::memcpy(&count, data + HEADER_SIZE, sizeof(count));
+    const std::size_t facets_end = HEADER_SIZE + 4 + std::size_t(count) * FACET_SIZE;
+    const bool solid = std::strncmp(data, "solid", 5) == 0;
+    if (count > 0 && size >= facets_end &&
+        (!solid || !is_text(data + HEADER_SIZE + 4, data + HEADER_SIZE + 4 + FACET_SIZE)))
+    {
+      if (size > facets_end)
+        ROS_DEBUG("%s has %zu bytes past its %u facets", path.c_str(), size - facets_end, count);
+      parse_binary(data, count, triangles);
+      return true;
+    }
+  }
+  if (size >= 5 && std::strncmp(data, "solid", 5) == 0 && parse_ascii(data, data + size, triangles))
+    return true;
+  ROS_ERROR("%s is not a valid STL file", path.c_str());
+  return false;
+}
+
+bool read_stl(const std::string &path, TriangleList &triangles, bool use_mmap)
+{
+  if (use_mmap)
+  {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+      ROS_ERROR("Cannot open %s", path.c_str());
+      return false;
+    }
+    struct stat st;
+    void *data = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && st.st_size > 0)
+      data = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data != MAP_FAILED)
+    {
+      madvise(data, st.st_size, MADV_SEQUENTIAL);
+      bool ok = parse_stl(path, static_cast<const char *>(data), st.st_size, triangles);
+      munmap(data, st.st_size);
+      return ok;
+    }
+    // e.g. empty files or file systems without mmap, read them instead
+  }
+
+  std::ifstream file(path, std::ios::binary | std::ios::ate);
+  if (!file)
+  {
+    ROS_ERROR("Cannot open %s", path.c_str());
+    return false;
+  }
+  std::vector<char> buffer(static_cast<std::size_t>(file.tellg()));
+  file.seekg(0);
+  if (!file.read(buffer.data(), buffer.size()))
+  {
+    ROS_ERROR("Cannot read %s", path.c_str());
+    return false;
+  }
+  return parse_stl(path, buffer.data(), buffer.size(), triangles);
+}
@@ -0,0 +1,166 @@
+#include <mars_perception/voxel_hash.h>
+#include <algorithm>
+#include <cmath>
+#include <numeric>
+
+// 21 bits per axis, offset so negative cells pack as well. Bit 63 is never
+// set, so an all ones key marks an empty slot.
+static const uint64_t EMPTY_KEY = ~uint64_t(0);
+static const int CELL_OFFSET = 1 << 20;
+
+static uint64_t cell_key(const Eigen::Vector3i &c)
+{
+  return (uint64_t((c.x() + CELL_OFFSET) & 0x1FFFFF) << 42) | (uint64_t((c.y() + CELL_OFFSET) & 0x1FFFFF) << 21) |
+         uint64_t((c.z() + CELL_OFFSET) & 0x1FFFFF);
+}
+
+static Eigen::Vector3i cell_of(const Eigen::Vector3f &p, float inv_cell)
+{
+  return Eigen::Vector3i(static_cast<int>(std::floor(p.x() * inv_cell)), static_cast<int>(std::floor(p.y() * inv_cell)),
+                         static_cast<int>(std::floor(p.z() * inv_cell)));
+}
+
+void VoxelHash::build_(const std::vector<Eigen::Vector3f> &points, const std::vector<int> &indices, float cell_size)
+{
+  cell_ = cell_size;
+  inv_cell_ = 1.0f / cell_size;
+  min_cell_.setConstant(std::numeric_limits<int>::max());
+  max_cell_.setConstant(std::numeric_limits<int>::min());
+
+  const size_t n = points.size();
+  std::vector<uint64_t> keys(n);
+  for (size_t i = 0; i < n; ++i)
+  {
+    Eigen::Vector3i c = cell_of(points[i], inv_cell_);
+    min_cell_ = min_cell_.cwiseMin(c);
+    max_cell_ = max_cell_.cwiseMax(c);
+    keys[i] = cell_key(c);
+  }
+
+  std::vector<uint32_t> order(n);
+  std::iota(order.begin(), order.end(), 0);
+  std::sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) { return keys[a] < keys[b]; });
+
+  x_.resize(n);
+  y_.resize(n);
+  z_.resize(n);
+  index_.resize(n);
+  size_t cells = 0;
+  for (size_t i = 0; i < n; ++i)
+  {
+    const Eigen::Vector3f &p = points[order[i]];
+    x_[i] = p.x();
+    y_[i] = p.y();
+    z_[i] = p.z();
+    index_[i] = indices[order[i]];
+    if (i == 0 || keys[order[i]] != keys[order[i - 1]])
+      ++cells;
+  }
+
+  // at most half full, so probe runs stay short
+  int bits = 4;
+  while ((size_t(1) << bits) < 2 * cells)
+    ++bits;
+  shift_ = 64 - bits;
+  table_.assign(size_t(1) << bits, Cell{EMPTY_KEY, 0, 0});
+  const size_t mask = table_.size() - 1;
+  for (size_t begin = 0; begin < n;)
+  {
+    uint64_t key = keys[order[begin]];
+    size_t end = begin + 1;
+    while (end < n && keys[order[end]] == key)
+      ++end;
+    size_t slot = (key * 0x9E3779B97F4A7C15ull) >> shift_;
+    while (table_[slot].key != EMPTY_KEY)
+      slot = (slot + 1) & mask;
+    table_[slot] = Cell{key, static_cast<uint32_t>(begin), static_cast<uint32_t>(end)};
+    begin = end;
+  }
+}
+
+const VoxelHash::Cell *VoxelHash::find_(const Eigen::Vector3i &c) const
+{
+  const uint64_t key = cell_key(c);
+  const size_t mask = table_.size() - 1;
+  for (size_t slot = (key * 0x9E3779B97F4A7C15ull) >> shift_;; slot = (slot + 1) & mask)
+  {
+    const Cell &cell = table_[slot];
+    if (cell.key == key)
+      return &cell;
+    if (cell.key == EMPTY_KEY)
+      return nullptr;
+  }
+}
+
+int VoxelHash::nearest(const Eigen::Vector3f &p, float max_sqr_dist, float &sqr_dist) const
+{
+  if (index_.empty())
+    return -1;
+
+  const Eigen::Vector3i center = cell_of(p, inv_cell_);
+  // ring k holds the cells k steps away from the center cell, none of
+  // their points is closer than (k - 1) cells plus the distance from p to
+  // the nearest face of its own cell
+  Eigen::Vector3f offset = p * inv_cell_ - center.cast<float>();
+  float face = std::min(offset.minCoeff(), 1.0f - offset.maxCoeff()) * cell_;
+  // past this ring every cell lies outside the occupied box
+  const int last_ring = std::max((center - min_cell_).maxCoeff(), (max_cell_ - center).maxCoeff());
+  // clamped before the cast, an unbounded distance (PCL's default
+  // max_range is DBL_MAX) does not fit an int
+  const double rings = std::ceil(std::sqrt(double(max_sqr_dist)) * inv_cell_) + 1.0;
+  const int radius_ring = rings < last_ring ? static_cast<int>(rings) : last_ring;
+  const Eigen::Vector3i lo = min_cell_ - center;
+  const Eigen::Vector3i hi = max_cell_ - center;
+
+  float best = max_sqr_dist;
+  int best_i = -1;
+  auto scan = [&](int dx, int dy, int dz) {
+    const Cell *cell = find_(center + Eigen::Vector3i(dx, dy, dz));
+    if (!cell)
+      return;
+    for (uint32_t j = cell->begin; j < cell->end; ++j)
+    {
+      float ex = x_[j] - p.x(), ey = y_[j] - p.y(), ez = z_[j] - p.z();
+      float d = ex * ex + ey * ey + ez * ez;
+      if (d < best)
+      {
+        best = d;
+        best_i = static_cast<int>(j);
+      }
+    }
+  };
+
+  for (int k = 0; k <= radius_ring; ++k)
+  {
+    if (k > 0)
+    {
+      float reach = (k - 1) * cell_ + face;
+      if (reach * reach >= best)
+        break;
+    }
+    for (int dx = std::max(-k, lo.x()); dx <= std::min(k, hi.x()); ++dx)
+    {
+      for (int dy = std::max(-k, lo.y()); dy <= std::min(k, hi.y()); ++dy)
+      {
+        if (dx == -k || dx == k || dy == -k || dy == k)
+        {
+          for (int dz = std::max(-k, lo.z()); dz <= std::min(k, hi.z()); ++dz)
+            scan(dx, dy, dz);
+        }
+        else
+        {
+          // inside the shell only its top and bottom cells are new
+          if (-k >= lo.z())
+            scan(dx, dy, -k);
+          if (k <= hi.z())
+            scan(dx, dy, k);
+        }
+      }
+    }
+  }
+
+  if (best_i < 0)
+    return -1;
+  sqr_dist = best;
+  return index_[best_i];
+}